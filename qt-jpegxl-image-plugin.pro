@@ -1,7 +1,7 @@
 TARGET = qjpegxl
 
-HEADERS = src/qjpegxlhandler_p.h src/util_p.h
-SOURCES = src/qjpegxlhandler.cpp
+HEADERS = src/qjpegxlcolorconverter_p.h src/qjpegxlcolorspacecache_p.h src/qjpegxldecoderpool_p.h src/qjpegxlencoderoutput_p.h src/qjpegxlhandler_p.h src/qjpegxlmemory_p.h src/qjpegxlprefetcher_p.h src/qjpegxlrunner_p.h src/util_p.h
+SOURCES = src/qjpegxlcolorconverter.cpp src/qjpegxlcolorspacecache.cpp src/qjpegxldecoderpool.cpp src/qjpegxlencoderoutput.cpp src/qjpegxlhandler.cpp src/qjpegxlmemory.cpp src/qjpegxlprefetcher.cpp src/qjpegxlrunner.cpp
 OTHER_FILES = src/jpegxl.json
 
 SOURCES += src/main.cpp
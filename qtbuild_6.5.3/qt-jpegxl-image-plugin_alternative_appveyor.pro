@@ -4,8 +4,8 @@ DEFINES += JXL_STATIC_DEFINE JXL_THREADS_STATIC_DEFINE
 
 INCLUDEPATH += ../libjxl/lib/include ../libjxl/build/lib/include
 
-HEADERS = ../src/qjpegxlhandler_p.h ../src/util_p.h
-SOURCES = ../src/qjpegxlhandler.cpp
+HEADERS = ../src/qjpegxlcolorconverter_p.h ../src/qjpegxlcolorspacecache_p.h ../src/qjpegxldecoderpool_p.h ../src/qjpegxlencoderoutput_p.h ../src/qjpegxlhandler_p.h ../src/qjpegxlmemory_p.h ../src/qjpegxlprefetcher_p.h ../src/qjpegxlrunner_p.h ../src/util_p.h
+SOURCES = ../src/qjpegxlcolorconverter.cpp ../src/qjpegxlcolorspacecache.cpp ../src/qjpegxldecoderpool.cpp ../src/qjpegxlencoderoutput.cpp ../src/qjpegxlhandler.cpp ../src/qjpegxlmemory.cpp ../src/qjpegxlprefetcher.cpp ../src/qjpegxlrunner.cpp
 OTHER_FILES = ../src/jpegxl.json
 
 SOURCES += ../src/main.cpp
@@ -0,0 +1,124 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#include <QAtomicInt>
+#include <QColorTransform>
+
+#include "qjpegxlcolorconverter_p.h"
+#include "qjpegxlrunner_p.h"
+#include "util_p.h"
+
+#include <string.h>
+
+// rows converted by one task
+static constexpr int kStripHeight = 64;
+
+namespace
+{
+struct StripJob {
+    QJpegXLColorConverter::StripFunction func;
+    void *opaque;
+    int height;
+    QAtomicInt failed;
+};
+
+JxlParallelRetCode initStrips(void *, size_t)
+{
+    return JXL_PARALLEL_RET_SUCCESS;
+}
+
+void runStrip(void *opaque, uint32_t value, size_t)
+{
+    StripJob *job = static_cast<StripJob *>(opaque);
+    const int first_row = int(value) * kStripHeight;
+    if (!job->func(job->opaque, first_row, qMin(kStripHeight, job->height - first_row))) {
+        job->failed.storeRelaxed(1);
+    }
+}
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+struct ConversionJob {
+    const QImage *source;
+    uchar *destination_bits;
+    qsizetype destination_bytes_per_line;
+    QImage::Format destination_format;
+    QColorTransform transform;
+};
+
+bool convertStrip(void *opaque, int first_row, int row_count)
+{
+    const ConversionJob *job = static_cast<const ConversionJob *>(opaque);
+
+    // view of the source rows, not a copy
+    QImage source_strip(job->source->constScanLine(first_row), job->source->width(), row_count, job->source->bytesPerLine(), job->source->format());
+    if (job->source->colorCount() > 0) {
+        // Indexed8 and Mono samples mean nothing without the palette
+        source_strip.setColorTable(job->source->colorTable());
+    }
+    const QImage converted_strip = source_strip.colorTransformed(job->transform, job->destination_format);
+    if (converted_strip.isNull()) {
+        return false;
+    }
+
+    const size_t line_size = size_t(qMin(converted_strip.bytesPerLine(), job->destination_bytes_per_line));
+    for (int y = 0; y < row_count; y++) {
+        memcpy(job->destination_bits + qsizetype(first_row + y) * job->destination_bytes_per_line, converted_strip.constScanLine(y), line_size);
+    }
+    return true;
+}
+#endif
+}
+
+bool QJpegXLColorConverter::forEachStrip(QJpegXLRunner *runner, int height, StripFunction func, void *opaque)
+{
+    if (height <= 0) {
+        return true;
+    }
+
+    StripJob job;
+    job.func = func;
+    job.opaque = opaque;
+    job.height = height;
+    job.failed.storeRelaxed(0);
+
+    const uint32_t strip_count = uint32_t((height + kStripHeight - 1) / kStripHeight);
+    if (QJpegXLRunner::run(runner, &job, initStrips, runStrip, 0, strip_count) != JXL_PARALLEL_RET_SUCCESS) {
+        return false;
+    }
+
+    return job.failed.loadRelaxed() == 0;
+}
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+QImage QJpegXLColorConverter::convertedToColorSpace(const QImage &image, const QColorSpace &colorspace, QImage::Format format, QJpegXLRunner *runner)
+{
+    if (image.isNull() || !image.colorSpace().isValid() || !colorspace.isValidTarget()) {
+        return QImage();
+    }
+
+    if (image.colorSpace() == colorspace || image.height() <= kStripHeight) {
+        return image.convertedToColorSpace(colorspace, format);
+    }
+
+    QImage converted = imageAlloc(image.width(), image.height(), format);
+    if (converted.isNull()) {
+        return QImage();
+    }
+
+    ConversionJob job;
+    job.source = &image;
+    job.destination_bits = converted.bits();
+    job.destination_bytes_per_line = converted.bytesPerLine();
+    job.destination_format = format;
+    job.transform = image.colorSpace().transformationToColorSpace(colorspace);
+
+    if (!forEachStrip(runner, image.height(), convertStrip, &job)) {
+        return QImage();
+    }
+
+    converted.setColorSpace(colorspace);
+    return converted;
+}
+#endif
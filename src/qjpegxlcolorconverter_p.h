@@ -0,0 +1,30 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#ifndef QJPEGXLCOLORCONVERTER_P_H
+#define QJPEGXLCOLORCONVERTER_P_H
+
+#include <QColorSpace>
+#include <QImage>
+
+class QJpegXLRunner;
+
+/* Color conversion of large images, split into horizontal strips
+ * which are processed in parallel on the threads of a QJpegXLRunner. */
+class QJpegXLColorConverter
+{
+public:
+    // returns false to report a failure, the remaining strips are still processed
+    typedef bool (*StripFunction)(void *opaque, int first_row, int row_count);
+
+    static bool forEachStrip(QJpegXLRunner *runner, int height, StripFunction func, void *opaque);
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+    // same result as image.convertedToColorSpace(colorspace, format)
+    static QImage convertedToColorSpace(const QImage &image, const QColorSpace &colorspace, QImage::Format format, QJpegXLRunner *runner);
+#endif
+};
+
+#endif // QJPEGXLCOLORCONVERTER_P_H
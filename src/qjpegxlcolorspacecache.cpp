@@ -0,0 +1,105 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#include <QCache>
+#include <QCryptographicHash>
+#include <QMutex>
+#include <QMutexLocker>
+
+#include "qjpegxlcolorspacecache_p.h"
+
+// number of colorspaces kept
+static constexpr int kMaxCachedColorSpaces = 64;
+
+namespace
+{
+struct ColorSpaceCache {
+    ColorSpaceCache()
+    {
+        colorspaces.setMaxCost(kMaxCachedColorSpaces);
+    }
+
+    QMutex mutex;
+    QCache<QByteArray, QColorSpace> colorspaces;
+};
+
+ColorSpaceCache *colorSpaceCache()
+{
+    static ColorSpaceCache cache;
+    return &cache;
+}
+
+template<typename T>
+void appendValue(QByteArray *key, const T &value)
+{
+    key->append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+}
+
+bool QJpegXLColorSpaceCache::find(const JxlColorEncoding &encoding, QColorSpace *colorspace)
+{
+    return find(encodingKey(encoding), colorspace);
+}
+
+void QJpegXLColorSpaceCache::insert(const JxlColorEncoding &encoding, const QColorSpace &colorspace)
+{
+    insert(encodingKey(encoding), colorspace);
+}
+
+QColorSpace QJpegXLColorSpaceCache::fromIccProfile(const QByteArray &icc_data)
+{
+    const QByteArray key = QByteArray("icc:") + QCryptographicHash::hash(icc_data, QCryptographicHash::Sha1) + QByteArray::number(icc_data.size());
+
+    QColorSpace colorspace;
+    if (!find(key, &colorspace)) {
+        colorspace = QColorSpace::fromIccProfile(icc_data);
+        insert(key, colorspace);
+    }
+    return colorspace;
+}
+
+/* Built field by field, the padding of JxlColorEncoding is not initialized. */
+QByteArray QJpegXLColorSpaceCache::encodingKey(const JxlColorEncoding &encoding)
+{
+    QByteArray key("enc:");
+    appendValue(&key, encoding.color_space);
+    appendValue(&key, encoding.white_point);
+    appendValue(&key, encoding.primaries);
+    appendValue(&key, encoding.transfer_function);
+    appendValue(&key, encoding.rendering_intent);
+
+    if (encoding.white_point == JXL_WHITE_POINT_CUSTOM) {
+        appendValue(&key, encoding.white_point_xy);
+    }
+    if (encoding.primaries == JXL_PRIMARIES_CUSTOM) {
+        appendValue(&key, encoding.primaries_red_xy);
+        appendValue(&key, encoding.primaries_green_xy);
+        appendValue(&key, encoding.primaries_blue_xy);
+    }
+    if (encoding.transfer_function == JXL_TRANSFER_FUNCTION_GAMMA) {
+        appendValue(&key, encoding.gamma);
+    }
+    return key;
+}
+
+bool QJpegXLColorSpaceCache::find(const QByteArray &key, QColorSpace *colorspace)
+{
+    ColorSpaceCache *cache = colorSpaceCache();
+    QMutexLocker locker(&cache->mutex);
+
+    const QColorSpace *cached = cache->colorspaces.object(key);
+    if (!cached) {
+        return false;
+    }
+    *colorspace = *cached;
+    return true;
+}
+
+void QJpegXLColorSpaceCache::insert(const QByteArray &key, const QColorSpace &colorspace)
+{
+    ColorSpaceCache *cache = colorSpaceCache();
+    QMutexLocker locker(&cache->mutex);
+    cache->colorspaces.insert(key, new QColorSpace(colorspace));
+}
@@ -0,0 +1,33 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#ifndef QJPEGXLCOLORSPACECACHE_P_H
+#define QJPEGXLCOLORSPACECACHE_P_H
+
+#include <QByteArray>
+#include <QColorSpace>
+
+#include <jxl/color_encoding.h>
+
+/* QColorSpace objects of recently seen color profiles, shared by all handlers.
+ * Images from one source usually carry the same profile, so it is parsed once
+ * and the transformations Qt builds for the colorspace are reused as well. */
+class QJpegXLColorSpaceCache
+{
+public:
+    // colorspace of an encoded profile seen before, the ICC profile is not needed then
+    static bool find(const JxlColorEncoding &encoding, QColorSpace *colorspace);
+    static void insert(const JxlColorEncoding &encoding, const QColorSpace &colorspace);
+
+    // same result as QColorSpace::fromIccProfile(icc_data)
+    static QColorSpace fromIccProfile(const QByteArray &icc_data);
+
+private:
+    static QByteArray encodingKey(const JxlColorEncoding &encoding);
+    static bool find(const QByteArray &key, QColorSpace *colorspace);
+    static void insert(const QByteArray &key, const QColorSpace &colorspace);
+};
+
+#endif // QJPEGXLCOLORSPACECACHE_P_H
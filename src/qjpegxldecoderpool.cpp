@@ -0,0 +1,120 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#include <QMutexLocker>
+#include <QtGlobal>
+
+#include "qjpegxldecoderpool_p.h"
+
+// decoders kept for reuse by default, more are destroyed when handed back
+static constexpr int kDefaultIdleDecoders = 8;
+
+QJpegXLDecoderPool::QJpegXLDecoderPool()
+    : m_max_idle_decoders(kDefaultIdleDecoders)
+{
+    if (qEnvironmentVariableIsSet("QT_JPEGXL_DECODER_POOL")) {
+        m_max_idle_decoders = qBound(0, qEnvironmentVariableIntValue("QT_JPEGXL_DECODER_POOL"), 64);
+    }
+}
+
+QJpegXLDecoderPool::~QJpegXLDecoderPool()
+{
+    for (PooledDecoder *pooled : m_idle_decoders) {
+        JxlDecoderDestroy(pooled->decoder);
+        delete pooled;
+    }
+}
+
+QJpegXLDecoderPool *QJpegXLDecoderPool::instance()
+{
+    static QJpegXLDecoderPool pool;
+    return &pool;
+}
+
+JxlDecoder *QJpegXLDecoderPool::checkOut(QJpegXLMemoryManager *memory)
+{
+    QJpegXLDecoderPool *pool = instance();
+    PooledDecoder *pooled = nullptr;
+
+    {
+        QMutexLocker locker(&pool->m_mutex);
+        if (!pool->m_idle_decoders.isEmpty()) {
+            pooled = pool->m_idle_decoders.takeLast();
+            pooled->memory.storeRelease(memory);
+            pool->m_busy_decoders.insert(pooled->decoder, pooled);
+            return pooled->decoder;
+        }
+    }
+
+    // the decoder itself outlives the handler, it is charged to the idle manager of the pool
+    pooled = new PooledDecoder;
+    pooled->jxl_manager.opaque = pooled;
+    pooled->jxl_manager.alloc = decoderAlloc;
+    pooled->jxl_manager.free = decoderFree;
+    pooled->memory.storeRelease(nullptr);
+    pooled->pool = pool;
+    pooled->decoder = JxlDecoderCreate(&pooled->jxl_manager);
+    if (!pooled->decoder) {
+        delete pooled;
+        return nullptr;
+    }
+    pooled->memory.storeRelease(memory);
+
+    QMutexLocker locker(&pool->m_mutex);
+    pool->m_busy_decoders.insert(pooled->decoder, pooled);
+    return pooled->decoder;
+}
+
+void QJpegXLDecoderPool::checkIn(JxlDecoder *decoder)
+{
+    if (!decoder) {
+        return;
+    }
+
+    QJpegXLDecoderPool *pool = instance();
+    PooledDecoder *pooled = nullptr;
+    {
+        QMutexLocker locker(&pool->m_mutex);
+        pooled = pool->m_busy_decoders.take(decoder);
+    }
+
+    if (!pooled) {
+        JxlDecoderDestroy(decoder);
+        return;
+    }
+
+    // the state of the last image is still released to the memory manager of its handler
+    JxlDecoderReset(decoder);
+    pooled->memory.storeRelease(nullptr);
+
+    {
+        QMutexLocker locker(&pool->m_mutex);
+        if (pool->m_idle_decoders.size() < pool->m_max_idle_decoders) {
+            pool->m_idle_decoders.append(pooled);
+            return;
+        }
+    }
+
+    JxlDecoderDestroy(decoder);
+    delete pooled;
+}
+
+void *QJpegXLDecoderPool::decoderAlloc(void *opaque, size_t size)
+{
+    PooledDecoder *pooled = static_cast<PooledDecoder *>(opaque);
+    QJpegXLMemoryManager *memory = pooled->memory.loadAcquire();
+    return memory ? memory->allocate(size) : pooled->pool->m_idle_memory.allocate(size);
+}
+
+void QJpegXLDecoderPool::decoderFree(void *opaque, void *address)
+{
+    PooledDecoder *pooled = static_cast<PooledDecoder *>(opaque);
+    QJpegXLMemoryManager *memory = pooled->memory.loadAcquire();
+    if (memory) {
+        memory->release(address);
+    } else {
+        pooled->pool->m_idle_memory.release(address);
+    }
+}
@@ -0,0 +1,53 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#ifndef QJPEGXLDECODERPOOL_P_H
+#define QJPEGXLDECODERPOOL_P_H
+
+#include <QAtomicPointer>
+#include <QHash>
+#include <QMutex>
+#include <QVector>
+
+#include <jxl/decode.h>
+
+#include "qjpegxlmemory_p.h"
+
+/* Idle JxlDecoder instances shared by all handlers of the process.
+ * A decoder is checked out in its initial state and handed back after JxlDecoderReset,
+ * so reading many small files does not create and destroy a decoder for each of them.
+ * While checked out, the allocations of the decoder are served by the memory manager
+ * of the handler; the decoder struct and idle decoders use a manager of the pool. */
+class QJpegXLDecoderPool
+{
+public:
+    static JxlDecoder *checkOut(QJpegXLMemoryManager *memory);
+    static void checkIn(JxlDecoder *decoder);
+
+private:
+    QJpegXLDecoderPool();
+    ~QJpegXLDecoderPool();
+    Q_DISABLE_COPY(QJpegXLDecoderPool)
+
+    static QJpegXLDecoderPool *instance();
+
+    struct PooledDecoder {
+        JxlDecoder *decoder;
+        JxlMemoryManager jxl_manager; // forwards to memory or to the idle manager of the pool
+        QAtomicPointer<QJpegXLMemoryManager> memory;
+        QJpegXLDecoderPool *pool;
+    };
+
+    static void *decoderAlloc(void *opaque, size_t size);
+    static void decoderFree(void *opaque, void *address);
+
+    QMutex m_mutex;
+    int m_max_idle_decoders;
+    QJpegXLMemoryManager m_idle_memory;
+    QVector<PooledDecoder *> m_idle_decoders;
+    QHash<JxlDecoder *, PooledDecoder *> m_busy_decoders;
+};
+
+#endif // QJPEGXLDECODERPOOL_P_H
@@ -0,0 +1,43 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#include <QtGlobal>
+
+#include "qjpegxlencoderoutput_p.h"
+
+#include <vector>
+
+/* Encoded data is written to the device in chunks of this size,
+ * the whole compressed file is never kept in memory. */
+static constexpr size_t kOutputChunkSize = 256 * 1024;
+
+bool QJpegXLEncoderOutput::write(JxlEncoder *encoder, QIODevice *device)
+{
+    std::vector<uint8_t> chunk(kOutputChunkSize);
+    qint64 total_written = 0;
+    JxlEncoderStatus status;
+    do {
+        uint8_t *next_out = chunk.data();
+        size_t avail_out = chunk.size();
+        status = JxlEncoderProcessOutput(encoder, &next_out, &avail_out);
+
+        if (status == JXL_ENC_ERROR) {
+            qWarning("JxlEncoderProcessOutput failed!");
+            return false;
+        }
+
+        const qint64 chunk_size = next_out - chunk.data();
+        if (chunk_size > 0) {
+            const qint64 write_status = device->write(reinterpret_cast<const char *>(chunk.data()), chunk_size);
+            if (write_status != chunk_size) {
+                qWarning("Write error: %s\n", qUtf8Printable(device->errorString()));
+                return false;
+            }
+            total_written += write_status;
+        }
+    } while (status == JXL_ENC_NEED_MORE_OUTPUT);
+
+    return status == JXL_ENC_SUCCESS && total_written > 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#ifndef QJPEGXLENCODEROUTPUT_P_H
+#define QJPEGXLENCODEROUTPUT_P_H
+
+#include <QIODevice>
+
+#include <jxl/encode.h>
+
+/* Output of JxlEncoder, shared by the plug-in and the QJpegXLJpeg library. */
+class QJpegXLEncoderOutput
+{
+public:
+    // compressed data is passed to the device as soon as libjxl produces it
+    static bool write(JxlEncoder *encoder, QIODevice *device);
+};
+
+#endif // QJPEGXLENCODEROUTPUT_P_H
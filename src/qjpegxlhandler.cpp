@@ -3,44 +3,484 @@
  * Author: Daniel Novomesky
  */
 
-#include <QThread>
+#include <QColorTransform>
+#include <QFloat16>
+#include <QImageReader>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPainter>
 #include <QtGlobal>
 
+#include "qjpegxlcolorconverter_p.h"
+#include "qjpegxlcolorspacecache_p.h"
+#include "qjpegxldecoderpool_p.h"
+#include "qjpegxlencoderoutput_p.h"
 #include "qjpegxlhandler_p.h"
+#include "qjpegxlprefetcher_p.h"
 #include "util_p.h"
 
 #include <jxl/encode.h>
-#include <jxl/thread_parallel_runner.h>
 
 #if JPEGXL_NUMERIC_VERSION > JPEGXL_COMPUTE_NUMERIC_VERSION(0, 9, 0)
 #include <jxl/cms.h>
 #endif
 
+#include <limits>
 #include <string.h>
+#include <vector>
+
+/* Seekable devices are fed to libjxl in chunks of this size,
+ * so input memory does not grow with the size of the file. */
+static constexpr qint64 kInputChunkSize = 256 * 1024;
+
+/* Thumbnails at most 1/8 of the original size are produced from
+ * the DC (1:8) pass of the image, without decoding the AC coefficients. */
+static constexpr int kDCDownsamplingRatio = 8;
+
+/* Header queries read JxlBasicInfo from the first bytes of the device,
+ * starting with this many and doubling up to the limit. */
+static constexpr qint64 kProbeSize = 4096;
+static constexpr qint64 kMaxProbeSize = 1024 * 1024;
+
+/* Peak luminance of SDR content in nits, the default intensity target of JPEG XL. */
+static constexpr float kSdrIntensityTarget = 255.0f;
+
+
+namespace
+{
+/* How the samples delivered by libjxl get into the image in the target format. */
+enum JxlPixelConversion {
+    PixelsCopied, // same memory layout, libjxl writes opaque alpha into the X channel
+    PixelsToRGB32, // RGB888 swizzled while decoding
+    PixelsToARGB32, // RGBA8888 swizzled while decoding
+    PixelsConvertedAfterwards, // QImage::convertTo on the decoded image
+};
+
+JxlPixelConversion pixelConversion(QImage::Format input_format, QImage::Format target_format)
+{
+    if (input_format == target_format) {
+        return PixelsCopied;
+    }
+
+    switch (target_format) {
+    case QImage::Format_RGB32:
+        return input_format == QImage::Format_RGB888 ? PixelsToRGB32 : PixelsConvertedAfterwards;
+    case QImage::Format_ARGB32:
+        return input_format == QImage::Format_RGBA8888 ? PixelsToARGB32 : PixelsConvertedAfterwards;
+    case QImage::Format_RGBX64:
+        return input_format == QImage::Format_RGBA64 ? PixelsCopied : PixelsConvertedAfterwards;
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+    case QImage::Format_RGBX16FPx4:
+        return input_format == QImage::Format_RGBA16FPx4 ? PixelsCopied : PixelsConvertedAfterwards;
+    case QImage::Format_RGBX32FPx4:
+        return input_format == QImage::Format_RGBA32FPx4 ? PixelsCopied : PixelsConvertedAfterwards;
+#endif
+    default:
+        return PixelsConvertedAfterwards;
+    }
+}
+
+/* Copies a rectangle of the frame into an image of its size.
+ * 8-bit RGB(A) samples are stored as QRgb values when conversion asks for it. */
+struct JxlRegionSink {
+    uchar *bits;
+    qsizetype bytes_per_line;
+    size_t bytes_per_pixel;
+    JxlPixelConversion conversion;
+    size_t left;
+    size_t top;
+    size_t width;
+    size_t height;
+};
+
+bool swizzledWhileDecoding(JxlPixelConversion conversion)
+{
+    return conversion == PixelsToRGB32 || conversion == PixelsToARGB32;
+}
+
+void storePixels(JxlPixelConversion conversion, size_t bytes_per_pixel, uchar *dest, const uchar *src, size_t count)
+{
+    QRgb *dest_rgb = reinterpret_cast<QRgb *>(dest);
+
+    switch (conversion) {
+    case PixelsToRGB32:
+        for (size_t i = 0; i < count; i++, src += 3) {
+            dest_rgb[i] = qRgb(src[0], src[1], src[2]);
+        }
+        break;
+    case PixelsToARGB32:
+        for (size_t i = 0; i < count; i++, src += 4) {
+            dest_rgb[i] = qRgba(src[0], src[1], src[2], src[3]);
+        }
+        break;
+    default:
+        memcpy(dest, src, count * bytes_per_pixel);
+        break;
+    }
+}
+
+void regionCallback(void *opaque, size_t x, size_t y, size_t num_pixels, const void *pixels)
+{
+    const JxlRegionSink *sink = static_cast<const JxlRegionSink *>(opaque);
+
+    if (y < sink->top || y >= sink->top + sink->height) {
+        return;
+    }
+
+    const size_t start_x = qMax(x, sink->left);
+    const size_t end_x = qMin(x + num_pixels, sink->left + sink->width);
+    if (start_x >= end_x) {
+        return;
+    }
+
+    const size_t dest_bytes_per_pixel = swizzledWhileDecoding(sink->conversion) ? sizeof(QRgb) : sink->bytes_per_pixel;
+    uchar *dest_line = sink->bits + qsizetype(y - sink->top) * sink->bytes_per_line;
+    const uchar *src = static_cast<const uchar *>(pixels);
+
+    storePixels(sink->conversion,
+                sink->bytes_per_pixel,
+                dest_line + (start_x - sink->left) * dest_bytes_per_pixel,
+                src + (start_x - x) * sink->bytes_per_pixel,
+                end_x - start_x);
+}
+
+float loadSample(const uchar *src, JxlDataType data_type)
+{
+    switch (data_type) {
+    case JXL_TYPE_FLOAT: {
+        float value;
+        memcpy(&value, src, sizeof(value));
+        return value;
+    }
+    case JXL_TYPE_FLOAT16: {
+        qfloat16 value;
+        memcpy(&value, src, sizeof(value));
+        return float(value);
+    }
+    case JXL_TYPE_UINT16: {
+        quint16 value;
+        memcpy(&value, src, sizeof(value));
+        return value;
+    }
+    default:
+        return *src;
+    }
+}
+
+void storeSample(uchar *dest, JxlDataType data_type, float value)
+{
+    switch (data_type) {
+    case JXL_TYPE_FLOAT:
+        memcpy(dest, &value, sizeof(value));
+        break;
+    case JXL_TYPE_FLOAT16: {
+        const qfloat16 half_value(value);
+        memcpy(dest, &half_value, sizeof(half_value));
+        break;
+    }
+    case JXL_TYPE_UINT16: {
+        const quint16 int_value = quint16(qBound(0.0f, value + 0.5f, 65535.0f));
+        memcpy(dest, &int_value, sizeof(int_value));
+        break;
+    }
+    default:
+        *dest = uchar(qBound(0.0f, value + 0.5f, 255.0f));
+        break;
+    }
+}
+
+/* Reduces a rectangle of the frame to one pixel per step x step block, the mean of the block
+ * (color weighted by alpha). The result is the same whether libjxl delivers the upsampled
+ * DC pass or the whole frame at full resolution, as it does for modular images.
+ * Rows of one row of blocks may come from several threads, each row of blocks has its own mutex. */
+struct JxlBlockSink {
+    JxlDataType data_type;
+    size_t bytes_per_sample;
+    size_t num_channels; // the 4th channel is alpha
+    size_t left;
+    size_t top;
+    size_t width;
+    size_t height;
+    size_t step;
+    size_t blocks_per_row;
+    std::vector<float> sums; // num_channels per block
+    QMutex *row_locks;
+};
+
+void blockCallback(void *opaque, size_t x, size_t y, size_t num_pixels, const void *pixels)
+{
+    JxlBlockSink *sink = static_cast<JxlBlockSink *>(opaque);
+
+    if (y < sink->top || y >= sink->top + sink->height) {
+        return;
+    }
+
+    const size_t start_x = qMax(x, sink->left);
+    const size_t end_x = qMin(x + num_pixels, sink->left + sink->width);
+    if (start_x >= end_x) {
+        return;
+    }
+
+    const size_t block_row = (y - sink->top) / sink->step;
+    const size_t bytes_per_pixel = sink->bytes_per_sample * sink->num_channels;
+    const uchar *src = static_cast<const uchar *>(pixels) + (start_x - x) * bytes_per_pixel;
+    const bool has_alpha = sink->num_channels == 4;
+
+    QMutexLocker locker(&sink->row_locks[block_row]);
+    float *row_sums = sink->sums.data() + block_row * sink->blocks_per_row * sink->num_channels;
+    for (size_t pixel_x = start_x; pixel_x < end_x; pixel_x++, src += bytes_per_pixel) {
+        float *block_sums = row_sums + (pixel_x - sink->left) / sink->step * sink->num_channels;
+        const float weight = has_alpha ? loadSample(src + 3 * sink->bytes_per_sample, sink->data_type) : 1.0f;
+        for (size_t channel = 0; channel < sink->num_channels; channel++) {
+            const float sample = loadSample(src + channel * sink->bytes_per_sample, sink->data_type);
+            block_sums[channel] += (channel < 3) ? sample * weight : sample;
+        }
+    }
+}
+
+/* Stores the mean of every block into the image, which has one pixel per block. */
+void storeBlocks(const JxlBlockSink *sink, JxlPixelConversion conversion, QImage *image)
+{
+    const size_t bytes_per_pixel = sink->bytes_per_sample * sink->num_channels;
+    const bool has_alpha = sink->num_channels == 4;
+    std::vector<uchar> row(sink->blocks_per_row * bytes_per_pixel);
+
+    for (int block_row = 0; block_row < image->height(); block_row++) {
+        const size_t block_height = qMin(sink->step, sink->height - size_t(block_row) * sink->step);
+        const float *block_sums = sink->sums.data() + size_t(block_row) * sink->blocks_per_row * sink->num_channels;
+        uchar *dest = row.data();
+
+        for (size_t block = 0; block < sink->blocks_per_row; block++, block_sums += sink->num_channels) {
+            const float pixel_count = float(qMin(sink->step, sink->width - block * sink->step) * block_height);
+            const float weight_sum = has_alpha ? block_sums[3] : pixel_count;
+            for (size_t channel = 0; channel < sink->num_channels; channel++, dest += sink->bytes_per_sample) {
+                float mean = 0.0f;
+                if (channel == 3) {
+                    mean = block_sums[channel] / pixel_count;
+                } else if (weight_sum > 0.0f) {
+                    mean = block_sums[channel] / weight_sum;
+                }
+                storeSample(dest, sink->data_type, mean);
+            }
+        }
+
+        storePixels(conversion, bytes_per_pixel, image->scanLine(block_row), row.data(), sink->blocks_per_row);
+    }
+}
+
+/* Puts a decoded layer on the canvas; both images have the same format.
+ * JXL_BLEND_BLEND without alpha is the same as JXL_BLEND_REPLACE. */
+void blendLayer(QImage *canvas, const QImage &layer, const QPoint &position, JxlBlendMode mode)
+{
+    if (mode == JXL_BLEND_BLEND && canvas->hasAlphaChannel()) {
+        QPainter painter(canvas);
+        painter.drawImage(position, layer);
+        return;
+    }
+
+    const QRect target = QRect(position, layer.size()).intersected(canvas->rect());
+    if (target.isEmpty()) {
+        return;
+    }
+
+    const qsizetype bytes_per_pixel = canvas->depth() / 8;
+    for (int y = target.top(); y <= target.bottom(); y++) {
+        memcpy(canvas->scanLine(y) + target.left() * bytes_per_pixel,
+               layer.constScanLine(y - position.y()) + (target.left() - position.x()) * bytes_per_pixel,
+               target.width() * bytes_per_pixel);
+    }
+}
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+/* Writes inverted CMY samples of the decoded rows into CMYK8888 (or ARGB32 sized)
+ * destination. The 4th byte gets alpha when present, BLACK is added later. */
+struct JxlCmykSink {
+    uchar *bits;
+    qsizetype bytes_per_line;
+    size_t num_channels;
+    size_t left;
+    size_t top;
+    size_t width;
+    size_t height;
+};
+
+void cmykCallback(void *opaque, size_t x, size_t y, size_t num_pixels, const void *pixels)
+{
+    const JxlCmykSink *sink = static_cast<const JxlCmykSink *>(opaque);
+
+    if (y < sink->top || y >= sink->top + sink->height) {
+        return;
+    }
+
+    const size_t start_x = qMax(x, sink->left);
+    const size_t end_x = qMin(x + num_pixels, sink->left + sink->width);
+    if (start_x >= end_x) {
+        return;
+    }
+
+    uchar *write_pointer = sink->bits + qsizetype(y - sink->top) * sink->bytes_per_line + (start_x - sink->left) * 4;
+    const uchar *src = static_cast<const uchar *>(pixels) + (start_x - x) * sink->num_channels;
+    for (size_t i = start_x; i < end_x; i++) {
+        write_pointer[0] = 255 - src[0]; // C
+        write_pointer[1] = 255 - src[1]; // M
+        write_pointer[2] = 255 - src[2]; // Y
+        write_pointer[3] = (sink->num_channels > 3) ? src[3] : 0;
+        write_pointer += 4;
+        src += sink->num_channels;
+    }
+}
+
+/* Adds BLACK to the rows filled by cmykCallback(). With alpha, the rows are
+ * converted to sRGB ARGB32 in place, strip by strip. */
+struct JxlCmykStrips {
+    uchar *bits;
+    qsizetype bytes_per_line;
+    int width;
+    const uchar *black; // first BLACK sample of the region
+    size_t black_stride;
+    bool has_alpha;
+    QColorTransform transform;
+};
+
+bool cmykStrip(void *opaque, int first_row, int row_count)
+{
+    const JxlCmykStrips *strips = static_cast<const JxlCmykStrips *>(opaque);
+    uchar *strip_bits = strips->bits + qsizetype(first_row) * strips->bytes_per_line;
+
+    // put BLACK into the 4th byte, alpha stored there by the callback is kept aside
+    QByteArray strip_alpha;
+    if (strips->has_alpha) {
+        strip_alpha.resize(row_count * strips->width);
+    }
+    uchar *alpha_pointer = reinterpret_cast<uchar *>(strip_alpha.data());
+    for (int y = 0; y < row_count; y++) {
+        uchar *write_pointer = strip_bits + qsizetype(y) * strips->bytes_per_line + 3;
+        const uchar *src_K = strips->black + size_t(first_row + y) * strips->black_stride;
+        for (int x = 0; x < strips->width; x++) {
+            if (strips->has_alpha) {
+                *alpha_pointer = *write_pointer;
+                alpha_pointer++;
+            }
+            *write_pointer = 255 - *src_K; // K
+            write_pointer += 4;
+            src_K++;
+        }
+    }
+
+    if (!strips->has_alpha) {
+        return true;
+    }
+
+    // view of the strip rows, not a copy
+    const QImage cmyk_strip(strip_bits, strips->width, row_count, strips->bytes_per_line, QImage::Format_CMYK8888);
+    const QImage rgb_strip = cmyk_strip.colorTransformed(strips->transform, QImage::Format_ARGB32);
+    if (rgb_strip.isNull()) {
+        return false;
+    }
+
+    // set alpha channel into ARGB image
+    const uchar *src_alpha = reinterpret_cast<const uchar *>(strip_alpha.constData());
+    for (int y = 0; y < row_count; y++) {
+        uchar *write_pointer = strip_bits + qsizetype(y) * strips->bytes_per_line;
+        memcpy(write_pointer, rgb_strip.constScanLine(y), size_t(strips->width) * 4);
+        for (int x = 0; x < strips->width; x++) {
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+            write_pointer += 3; // skip BGR
+            *write_pointer = *src_alpha; // A
+            write_pointer++;
+            src_alpha++;
+#else
+            *write_pointer = *src_alpha;
+            write_pointer += 4; // move 4 bytes (skip RGB)
+            src_alpha++;
+#endif
+        }
+    }
+    return true;
+}
+#endif
+
+qint64 imageBytes(const QSize &size, QImage::Format format)
+{
+    const qint64 bytes_per_line = ((qint64(size.width()) * QImage::toPixelFormat(format).bitsPerPixel() + 31) / 32) * 4;
+    return bytes_per_line * size.height();
+}
+
+size_t bytesPerPixel(const JxlPixelFormat &format)
+{
+    switch (format.data_type) {
+    case JXL_TYPE_FLOAT:
+        return 4 * size_t(format.num_channels);
+    case JXL_TYPE_UINT16:
+    case JXL_TYPE_FLOAT16:
+        return 2 * size_t(format.num_channels);
+    default:
+        return size_t(format.num_channels);
+    }
+}
+}
 
 QJpegXLHandler::QJpegXLHandler()
     : m_parseState(ParseJpegXLNotParsed)
     , m_quality(90)
     , m_currentimage_index(0)
     , m_previousimage_index(-1)
+    , m_decoder_frame_index(0)
+    , m_input_mode(InputBuffered)
+    , m_input_start(0)
+    , m_input_eof(false)
+    , m_mapped_data(nullptr)
+    , m_mapped_size(0)
     , m_decoder(nullptr)
-    , m_runner(nullptr)
+    , m_basicinfo_probed(false)
+    , m_layer_mode(qEnvironmentVariableIntValue("QT_JPEGXL_LAYERS") > 0)
+    , m_canvas_key(0)
     , m_next_image_delay(0)
+    , m_prefetcher(nullptr)
+    , m_prefetch_depth(qBound(0, qEnvironmentVariableIntValue("QT_JPEGXL_PREFETCH"), 16))
+    , m_memory_budget(qint64(qMax(0, qEnvironmentVariableIntValue("QT_JPEGXL_MEMORY_LIMIT"))) * 1024 * 1024)
+    , m_memory(m_memory_budget)
     , m_isCMYK(false)
     , m_cmyk_channel_id(0)
-    , m_alpha_channel_id(0)
     , m_input_image_format(QImage::Format_Invalid)
     , m_target_image_format(QImage::Format_Invalid)
+    , m_prefer_preview(qEnvironmentVariableIntValue("QT_JPEGXL_PREFER_PREVIEW") > 0)
+    , m_decode_mode(DecodeFullFrame)
+    , m_output_colorspace(OutputOriginal)
+    , m_output_profile_set(false)
+    , m_tone_map_nits(qMax(0, qEnvironmentVariableIntValue("QT_JPEGXL_TONEMAP")))
+    , m_tone_mapped(false)
 {
+    const QByteArray output_colorspace = qgetenv("QT_JPEGXL_COLORSPACE").toLower();
+    if (output_colorspace == "srgb") {
+        m_output_colorspace = OutputSRgb;
+    } else if (output_colorspace == "srgb-linear") {
+        m_output_colorspace = OutputSRgbLinear;
+    } else if (output_colorspace == "display-p3") {
+        m_output_colorspace = OutputDisplayP3;
+    }
+
+    m_frame_cache.setMaxCost(qBound(0, qEnvironmentVariableIntValue("QT_JPEGXL_FRAME_CACHE"), 1024 * 1024) * 1024);
 }
 
 QJpegXLHandler::~QJpegXLHandler()
 {
-    if (m_runner) {
-        JxlThreadParallelRunnerDestroy(m_runner);
-    }
+    stopPrefetch();
     if (m_decoder) {
-        JxlDecoderDestroy(m_decoder);
+        QJpegXLDecoderPool::checkIn(m_decoder);
+    }
+
+    if (m_memory.allocationCount() > 0 && qEnvironmentVariableIntValue("QT_JPEGXL_MEMORY_STATS") > 0) {
+        qDebug("JXL plug-in memory: peak %lld KiB, %lld allocations, %lld bytes not released, %lld KiB kept for reuse in the process",
+               m_memory.peakBytes() / 1024,
+               m_memory.allocationCount(),
+               m_memory.currentBytes(),
+               QJpegXLMemoryManager::cachedBytes() / 1024);
+    }
+
+    QObject::disconnect(m_mapped_file_closing);
+    if (m_mapped_data && m_mapped_file) {
+        m_mapped_file->unmap(m_mapped_data);
     }
 }
 
@@ -93,6 +533,74 @@ bool QJpegXLHandler::ensureParsed() const
     return that->ensureDecoder();
 }
 
+/* Basic info for Size, Animation, ImageFormat and loopCount() queries.
+ * Before the image is read, it is probed from peeked bytes which stay in the device. */
+bool QJpegXLHandler::ensureBasicInfo() const
+{
+    if (m_parseState != ParseJpegXLNotParsed) {
+        return ensureParsed();
+    }
+    if (m_basicinfo_probed) {
+        return true;
+    }
+
+    QJpegXLHandler *that = const_cast<QJpegXLHandler *>(this);
+
+    if (!that->probeBasicInfo()) {
+        return ensureParsed();
+    }
+    return true;
+}
+
+bool QJpegXLHandler::probeBasicInfo()
+{
+    if (!device()) {
+        return false;
+    }
+
+    JxlDecoder *decoder = QJpegXLDecoderPool::checkOut(&m_memory);
+    if (!decoder) {
+        return false;
+    }
+
+    if (JxlDecoderSubscribeEvents(decoder, JXL_DEC_BASIC_INFO) != JXL_DEC_SUCCESS) {
+        QJpegXLDecoderPool::checkIn(decoder);
+        return false;
+    }
+
+    for (qint64 probe_size = kProbeSize; probe_size <= kMaxProbeSize; probe_size *= 2) {
+        const QByteArray header = device()->peek(probe_size);
+        if (header.isEmpty()) {
+            break;
+        }
+
+        JxlDecoderRewind(decoder);
+        if (JxlDecoderSetInput(decoder, reinterpret_cast<const uint8_t *>(header.constData()), header.size()) != JXL_DEC_SUCCESS) {
+            break;
+        }
+
+        const bool complete = header.size() < probe_size;
+        if (complete) {
+            JxlDecoderCloseInput(decoder);
+        }
+
+        const JxlDecoderStatus status = JxlDecoderProcessInput(decoder);
+        if (status == JXL_DEC_BASIC_INFO) {
+            m_basicinfo_probed = JxlDecoderGetBasicInfo(decoder, &m_basicinfo) == JXL_DEC_SUCCESS && m_basicinfo.xsize > 0 && m_basicinfo.ysize > 0;
+            break;
+        }
+
+        JxlDecoderReleaseInput(decoder);
+        if (status != JXL_DEC_NEED_MORE_INPUT || complete) {
+            break;
+        }
+    }
+
+    JxlDecoderReleaseInput(decoder);
+    QJpegXLDecoderPool::checkIn(decoder);
+    return m_basicinfo_probed;
+}
+
 bool QJpegXLHandler::ensureALLCounted() const
 {
     if (!ensureParsed()) {
@@ -114,71 +622,88 @@ bool QJpegXLHandler::ensureDecoder()
         return true;
     }
 
-    m_rawData = device()->readAll();
-
-    if (m_rawData.isEmpty()) {
+    if (!device()) {
         return false;
     }
 
-    JxlSignature signature = JxlSignatureCheck(reinterpret_cast<const uint8_t *>(m_rawData.constData()), m_rawData.size());
-    if (signature != JXL_SIG_CODESTREAM && signature != JXL_SIG_CONTAINER) {
-        m_parseState = ParseJpegXLError;
-        return false;
-    }
+    const uint8_t *input_data = nullptr;
+    size_t input_size = 0;
 
-    m_decoder = JxlDecoderCreate(nullptr);
-    if (!m_decoder) {
-        qWarning("ERROR: JxlDecoderCreate failed");
-        m_parseState = ParseJpegXLError;
-        return false;
+    /* Regular files are mapped into memory, so libjxl reads them
+     * directly from the page cache without any copy. */
+    QFileDevice *file = qobject_cast<QFileDevice *>(device());
+    if (file && !file->isSequential() && file->size() > file->pos()
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+        // QByteArray of the prefetcher and of releaseMapping() holds at most INT_MAX bytes
+        && file->size() - file->pos() <= std::numeric_limits<int>::max()
+#endif
+    ) {
+        const qint64 map_start = file->pos();
+        const qsizetype map_size = qsizetype(file->size() - map_start);
+        m_mapped_data = file->map(map_start, map_size);
+        if (m_mapped_data) {
+            m_mapped_file = file;
+            m_mapped_size = map_size;
+            // closing the file unmaps the data, the application may do so between two frames
+            m_mapped_file_closing = QObject::connect(file, &QIODevice::aboutToClose, [this]() {
+                releaseMapping();
+            });
+            m_input_mode = InputMapped;
+            m_input_start = map_start;
+            m_input_eof = true;
+            file->seek(file->size());
+
+            input_data = m_mapped_data;
+            input_size = map_size;
+        }
     }
 
-    int num_worker_threads = QThread::idealThreadCount();
-    if (!m_runner && num_worker_threads >= 4) {
-        /* use half of the threads because plug-in is usually used in environment
-         * where application performs another tasks in backround (pre-load other images) */
-        num_worker_threads = num_worker_threads / 2;
-        num_worker_threads = qBound(2, num_worker_threads, 64);
-        m_runner = JxlThreadParallelRunnerCreate(nullptr, num_worker_threads);
-
-        if (JxlDecoderSetParallelRunner(m_decoder, JxlThreadParallelRunner, m_runner) != JXL_DEC_SUCCESS) {
-            qWarning("ERROR: JxlDecoderSetParallelRunner failed");
-            m_parseState = ParseJpegXLError;
-            return false;
+    if (m_input_mode != InputMapped) {
+        /* Sequential devices cannot be re-read on rewind(),
+         * so they are still buffered completely. */
+        if (!device()->isSequential()) {
+            m_input_mode = InputStreamed;
+            m_input_start = device()->pos();
+            m_rawData = device()->read(kInputChunkSize);
+            m_input_eof = device()->atEnd();
+        } else {
+            m_input_mode = InputBuffered;
+            m_rawData = device()->readAll();
+            m_input_eof = true;
         }
+
+        input_data = reinterpret_cast<const uint8_t *>(m_rawData.constData());
+        input_size = m_rawData.size();
     }
 
-    if (JxlDecoderSetInput(m_decoder, reinterpret_cast<const uint8_t *>(m_rawData.constData()), m_rawData.size()) != JXL_DEC_SUCCESS) {
-        qWarning("ERROR: JxlDecoderSetInput failed");
-        m_parseState = ParseJpegXLError;
+    if (input_size == 0) {
         return false;
     }
 
-    JxlDecoderCloseInput(m_decoder);
-
-    JxlDecoderStatus status = JxlDecoderSubscribeEvents(m_decoder, JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING | JXL_DEC_FRAME);
-    if (status == JXL_DEC_ERROR) {
-        qWarning("ERROR: JxlDecoderSubscribeEvents failed");
+    JxlSignature signature = JxlSignatureCheck(input_data, input_size);
+    if (signature != JXL_SIG_CODESTREAM && signature != JXL_SIG_CONTAINER) {
         m_parseState = ParseJpegXLError;
         return false;
     }
 
-    status = JxlDecoderProcessInput(m_decoder);
-    if (status == JXL_DEC_ERROR) {
-        qWarning("ERROR: JXL decoding failed");
+    m_decoder = QJpegXLDecoderPool::checkOut(&m_memory);
+    if (!m_decoder) {
+        qWarning("ERROR: JxlDecoderCreate failed");
         m_parseState = ParseJpegXLError;
         return false;
     }
-    if (status == JXL_DEC_NEED_MORE_INPUT) {
-        qWarning("ERROR: JXL data incomplete");
+
+    if (JxlDecoderSetInput(m_decoder, input_data, input_size) != JXL_DEC_SUCCESS) {
+        qWarning("ERROR: JxlDecoderSetInput failed");
         m_parseState = ParseJpegXLError;
         return false;
     }
 
-    status = JxlDecoderGetBasicInfo(m_decoder, &m_basicinfo);
-    if (status != JXL_DEC_SUCCESS) {
-        qWarning("ERROR: JXL basic info not available");
-        m_parseState = ParseJpegXLError;
+    if (m_input_eof) {
+        JxlDecoderCloseInput(m_decoder);
+    }
+
+    if (!startDecoding()) {
         return false;
     }
 
@@ -218,101 +743,119 @@ bool QJpegXLHandler::ensureDecoder()
     return true;
 }
 
-bool QJpegXLHandler::countALLFrames()
+bool QJpegXLHandler::startDecoding()
 {
-    if (m_parseState != ParseJpegXLBasicInfoParsed) {
-        return false;
+    if (m_layer_mode && JxlDecoderSetCoalescing(m_decoder, JXL_FALSE) != JXL_DEC_SUCCESS) {
+        qWarning("ERROR: JxlDecoderSetCoalescing failed");
+        m_layer_mode = false;
     }
 
-    JxlDecoderStatus status = JxlDecoderProcessInput(m_decoder);
-    if (status != JXL_DEC_COLOR_ENCODING) {
-        qWarning("Unexpected event %d instead of JXL_DEC_COLOR_ENCODING", status);
+    JxlDecoderStatus status = JxlDecoderSubscribeEvents(m_decoder, JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING | JXL_DEC_FRAME);
+    if (status == JXL_DEC_ERROR) {
+        qWarning("ERROR: JxlDecoderSubscribeEvents failed");
         m_parseState = ParseJpegXLError;
         return false;
     }
 
-    bool is_gray = m_basicinfo.num_color_channels == 1 && m_basicinfo.alpha_bits == 0;
-    JxlColorEncoding color_encoding;
-    if (m_basicinfo.uses_original_profile == JXL_FALSE && m_basicinfo.have_animation == JXL_FALSE) {
-#if JPEGXL_NUMERIC_VERSION > JPEGXL_COMPUTE_NUMERIC_VERSION(0, 9, 0)
-        if (!is_gray) {
-            const JxlCmsInterface *jxlcms = JxlGetDefaultCms();
-            if (jxlcms) {
-                status = JxlDecoderSetCms(m_decoder, *jxlcms);
-                if (status != JXL_DEC_SUCCESS) {
-                    qWarning("JxlDecoderSetCms ERROR");
-                }
-            } else {
-                qWarning("No JPEG XL CMS Interface");
-            }
-        }
-#endif
-        JxlColorEncodingSetToSRGB(&color_encoding, is_gray ? JXL_TRUE : JXL_FALSE);
-        JxlDecoderSetPreferredColorProfile(m_decoder, &color_encoding);
+    status = processInput();
+    if (status == JXL_DEC_ERROR) {
+        qWarning("ERROR: JXL decoding failed");
+        m_parseState = ParseJpegXLError;
+        return false;
     }
-
-    bool loadalpha = false;
-    if (m_basicinfo.alpha_bits > 0) {
-        loadalpha = true;
+    if (status == JXL_DEC_NEED_MORE_INPUT) {
+        qWarning("ERROR: JXL data incomplete");
+        m_parseState = ParseJpegXLError;
+        return false;
     }
 
-    m_input_pixel_format.endianness = JXL_NATIVE_ENDIAN;
-    m_input_pixel_format.align = 4;
+    status = JxlDecoderGetBasicInfo(m_decoder, &m_basicinfo);
+    if (status != JXL_DEC_SUCCESS) {
+        qWarning("ERROR: JXL basic info not available");
+        m_parseState = ParseJpegXLError;
+        return false;
+    }
 
-    if (m_basicinfo.bits_per_sample > 8) { // high bit depth
-#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
-        bool is_fp = m_basicinfo.exponent_bits_per_sample > 0 && m_basicinfo.num_color_channels == 3;
-#endif
+    return true;
+}
 
-        m_input_pixel_format.num_channels = 4;
+/* Layers cannot be composited by the plug-in (still image, CMYK, arithmetic blend modes)
+ * or the reference slots do not fit the memory limit, so the decoder is started again with coalescing enabled. */
+bool QJpegXLHandler::restartCoalesced()
+{
+    JxlDecoderReset(m_decoder);
+    m_layer_mode = false;
 
-        if (is_gray) {
-            m_input_pixel_format.num_channels = 1;
-            m_input_pixel_format.data_type = JXL_TYPE_UINT16;
-            m_input_image_format = m_target_image_format = QImage::Format_Grayscale16;
-#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
-        } else if (m_basicinfo.bits_per_sample > 16 && is_fp) {
-            m_input_pixel_format.data_type = JXL_TYPE_FLOAT;
-            m_input_image_format = QImage::Format_RGBA32FPx4;
-            if (loadalpha)
-                m_target_image_format = QImage::Format_RGBA32FPx4;
-            else
-                m_target_image_format = QImage::Format_RGBX32FPx4;
-#endif
-        } else {
-#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
-            m_input_pixel_format.data_type = is_fp ? JXL_TYPE_FLOAT16 : JXL_TYPE_UINT16;
-            m_input_image_format = is_fp ? QImage::Format_RGBA16FPx4 : QImage::Format_RGBA64;
-            if (loadalpha)
-                m_target_image_format = is_fp ? QImage::Format_RGBA16FPx4 : QImage::Format_RGBA64;
-            else
-                m_target_image_format = is_fp ? QImage::Format_RGBX16FPx4 : QImage::Format_RGBX64;
-#else
-            m_input_pixel_format.data_type = JXL_TYPE_UINT16;
-            m_input_image_format = QImage::Format_RGBA64;
-            if (loadalpha)
-                m_target_image_format = QImage::Format_RGBA64;
-            else
-                m_target_image_format = QImage::Format_RGBX64;
-#endif
+    m_framedelays.clear();
+    m_frame_index.clear();
+    m_layers.clear();
+    m_isCMYK = false;
+    m_cmyk_channel_id = 0;
+
+    if (!resetInput()) {
+        m_parseState = ParseJpegXLError;
+        return false;
+    }
+
+    if (!startDecoding()) {
+        return false;
+    }
+
+    m_parseState = ParseJpegXLBasicInfoParsed;
+    return countALLFrames();
+}
+
+bool QJpegXLHandler::countALLFrames()
+{
+    if (m_parseState != ParseJpegXLBasicInfoParsed) {
+        return false;
+    }
+
+    if (m_layer_mode && !m_basicinfo.have_animation) {
+        return restartCoalesced();
+    }
+
+    JxlDecoderStatus status = processInput();
+    if (status != JXL_DEC_COLOR_ENCODING) {
+        qWarning("Unexpected event %d instead of JXL_DEC_COLOR_ENCODING", status);
+        m_parseState = ParseJpegXLError;
+        return false;
+    }
+
+    bool is_gray = m_basicinfo.num_color_channels == 1 && m_basicinfo.alpha_bits == 0;
+    JxlColorEncoding color_encoding;
+    m_output_profile_set = false;
+    m_tone_mapped = m_tone_map_nits > 0 && isHighDynamicRange();
+    if ((m_output_colorspace != OutputOriginal || m_tone_mapped) && !hasBlackChannel()) {
+        m_output_profile_set = setOutputColorProfile();
+        if (!m_output_profile_set) {
+            qWarning("JXL image cannot be converted to the colorspace requested by QT_JPEGXL_COLORSPACE or QT_JPEGXL_TONEMAP");
         }
-    } else { // 8bit depth
-        m_input_pixel_format.data_type = JXL_TYPE_UINT8;
+    }
+    m_tone_mapped = m_tone_mapped && m_output_profile_set;
 
-        if (is_gray) {
-            m_input_pixel_format.num_channels = 1;
-            m_input_image_format = m_target_image_format = QImage::Format_Grayscale8;
-        } else {
-            if (loadalpha) {
-                m_input_pixel_format.num_channels = 4;
-                m_input_image_format = QImage::Format_RGBA8888;
-                m_target_image_format = QImage::Format_ARGB32;
+    if (!m_output_profile_set && m_basicinfo.uses_original_profile == JXL_FALSE && m_basicinfo.have_animation == JXL_FALSE) {
+#if JPEGXL_NUMERIC_VERSION > JPEGXL_COMPUTE_NUMERIC_VERSION(0, 9, 0)
+        if (!is_gray) {
+            const JxlCmsInterface *jxlcms = JxlGetDefaultCms();
+            if (jxlcms) {
+                status = JxlDecoderSetCms(m_decoder, *jxlcms);
+                if (status != JXL_DEC_SUCCESS) {
+                    qWarning("JxlDecoderSetCms ERROR");
+                }
             } else {
-                m_input_pixel_format.num_channels = 3;
-                m_input_image_format = QImage::Format_RGB888;
-                m_target_image_format = QImage::Format_RGB32;
+                qWarning("No JPEG XL CMS Interface");
             }
         }
+#endif
+        JxlColorEncodingSetToSRGB(&color_encoding, is_gray ? JXL_TRUE : JXL_FALSE);
+        JxlDecoderSetPreferredColorProfile(m_decoder, &color_encoding);
+    }
+
+    selectFormats();
+    if (m_tone_mapped) {
+        // tone mapped samples fit into 8 bits, no float frame is allocated
+        selectEightBitFormats();
     }
 
     status = JxlDecoderGetColorAsEncodedProfile(m_decoder,
@@ -325,7 +868,10 @@ bool QJpegXLHandler::countALLFrames()
     if (status == JXL_DEC_SUCCESS && color_encoding.color_space == JXL_COLOR_SPACE_RGB && color_encoding.white_point == JXL_WHITE_POINT_D65
         && color_encoding.primaries == JXL_PRIMARIES_SRGB && color_encoding.transfer_function == JXL_TRANSFER_FUNCTION_SRGB) {
         m_colorspace = QColorSpace(QColorSpace::SRgb);
+    } else if (status == JXL_DEC_SUCCESS && QJpegXLColorSpaceCache::find(color_encoding, &m_colorspace)) {
+        // the same encoded profile was seen before, its ICC profile is not needed
     } else {
+        const bool is_encoded = status == JXL_DEC_SUCCESS;
         size_t icc_size = 0;
         if (JxlDecoderGetICCProfileSize(m_decoder,
 #if JPEGXL_NUMERIC_VERSION < JPEGXL_COMPUTE_NUMERIC_VERSION(0, 9, 0)
@@ -344,7 +890,10 @@ bool QJpegXLHandler::countALLFrames()
                                                    reinterpret_cast<uint8_t *>(icc_data.data()),
                                                    icc_data.size())
                     == JXL_DEC_SUCCESS) {
-                    m_colorspace = QColorSpace::fromIccProfile(icc_data);
+                    m_colorspace = QJpegXLColorSpaceCache::fromIccProfile(icc_data);
+                    if (is_encoded) {
+                        QJpegXLColorSpaceCache::insert(color_encoding, m_colorspace);
+                    }
 
                     if (!m_colorspace.isValid()) {
                         qWarning("JXL image has Qt-unsupported or invalid ICC profile!");
@@ -363,8 +912,13 @@ bool QJpegXLHandler::countALLFrames()
     if (m_basicinfo.have_animation) { // count all frames
         JxlFrameHeader frame_header;
         int delay;
+        int frame_first_layer = 0;
+        int slot_origin[4]; // earliest frame the content of the reference slot depends on
+        for (int &origin : slot_origin) {
+            origin = std::numeric_limits<int>::max(); // empty slot, same after a restart
+        }
 
-        for (status = JxlDecoderProcessInput(m_decoder); status != JXL_DEC_SUCCESS; status = JxlDecoderProcessInput(m_decoder)) {
+        for (status = processInput(); status != JXL_DEC_SUCCESS; status = processInput()) {
             if (status != JXL_DEC_FRAME) {
                 switch (status) {
                 case JXL_DEC_ERROR:
@@ -387,6 +941,51 @@ bool QJpegXLHandler::countALLFrames()
                 return false;
             }
 
+            const bool is_last = frame_header.is_last == JXL_TRUE;
+            if (m_layer_mode) { // index of the layers composited by the plug-in
+                const JxlLayerInfo &layer_info = frame_header.layer_info;
+                LayerIndexEntry layer;
+                if (layer_info.have_crop == JXL_TRUE) {
+                    layer.rect = QRect(layer_info.crop_x0, layer_info.crop_y0, layer_info.xsize, layer_info.ysize);
+                } else {
+                    layer.rect = fullRect();
+                }
+                layer.blend_mode = layer_info.blend_info.blendmode;
+                layer.blend_source = layer_info.blend_info.source & 3;
+                layer.blend_main_alpha = layer_info.blend_info.alpha == 0 && layer_info.blend_info.clamp == JXL_FALSE;
+                // frames with duration are saved only to a non-zero slot
+                if (!is_last && (frame_header.duration == 0 || layer_info.save_as_reference != 0)) {
+                    layer.saved_as = int(layer_info.save_as_reference & 3);
+                } else {
+                    layer.saved_as = -1;
+                }
+                m_layers.append(layer);
+
+                const int frame_number = m_frame_index.count();
+                int origin = frame_number;
+                if (layer.blend_mode != JXL_BLEND_REPLACE || !layer.rect.contains(fullRect())) {
+                    origin = qMin(origin, slot_origin[layer.blend_source]);
+                }
+                if (layer.saved_as >= 0) {
+                    slot_origin[layer.saved_as] = origin;
+                }
+
+                // layers without duration belong to the next frame
+                if (frame_header.duration == 0 && !is_last) {
+                    continue;
+                }
+
+                FrameIndexEntry entry;
+                entry.first_layer = frame_first_layer;
+                entry.layer_count = m_layers.count() - frame_first_layer;
+                for (int slot : slot_origin) {
+                    origin = qMin(origin, slot);
+                }
+                entry.restart_frame = origin;
+                m_frame_index.append(entry);
+                frame_first_layer = m_layers.count();
+            }
+
             if (m_basicinfo.animation.tps_denominator > 0 && m_basicinfo.animation.tps_numerator > 0) {
                 delay = (int)(0.5 + 1000.0 * frame_header.duration * m_basicinfo.animation.tps_denominator / m_basicinfo.animation.tps_numerator);
             } else {
@@ -395,7 +994,7 @@ bool QJpegXLHandler::countALLFrames()
 
             m_framedelays.append(delay);
 
-            if (frame_header.is_last == JXL_TRUE) {
+            if (is_last) {
                 break;
             }
         }
@@ -406,6 +1005,10 @@ bool QJpegXLHandler::countALLFrames()
             return false;
         }
 
+        if (m_layer_mode && m_framedelays.count() == 1) {
+            return restartCoalesced();
+        }
+
         if (m_framedelays.count() == 1) {
             qWarning("JXL file was marked as animation but it has only one frame.");
             m_basicinfo.have_animation = JXL_FALSE;
@@ -446,7 +1049,6 @@ bool QJpegXLHandler::countALLFrames()
 
                                 if (channel_info.type == JXL_CHANNEL_ALPHA) {
                                     alpha_found = true;
-                                    m_alpha_channel_id = alpha_index;
                                     break;
                                 }
                             }
@@ -464,7 +1066,6 @@ bool QJpegXLHandler::countALLFrames()
                 break;
             } else if ((channel_info.type == JXL_CHANNEL_ALPHA) && !alpha_found) {
                 alpha_found = true;
-                m_alpha_channel_id = index;
             }
         }
 
@@ -474,6 +1075,20 @@ bool QJpegXLHandler::countALLFrames()
     }
 #endif
 
+    if (m_layer_mode) {
+        bool supported_layers = !m_isCMYK;
+        for (const LayerIndexEntry &layer : m_layers) {
+            // QPainter blends with the main alpha channel only
+            if ((layer.blend_mode != JXL_BLEND_REPLACE && layer.blend_mode != JXL_BLEND_BLEND) || !layer.blend_main_alpha) {
+                supported_layers = false;
+            }
+        }
+
+        if (!supported_layers) {
+            return restartCoalesced();
+        }
+    }
+
     if (!rewind()) {
         return false;
     }
@@ -485,262 +1100,77 @@ bool QJpegXLHandler::countALLFrames()
 
 bool QJpegXLHandler::decode_one_frame()
 {
-    JxlDecoderStatus status = JxlDecoderProcessInput(m_decoder);
-    if (status != JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
-        qWarning("Unexpected event %d instead of JXL_DEC_NEED_IMAGE_OUT_BUFFER", status);
-        m_parseState = ParseJpegXLError;
-        return false;
-    }
-
-    if (m_isCMYK) { // CMYK decoding
-#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
-        uchar *pixels_cmy = nullptr;
-        uchar *pixels_black = nullptr;
-
-        JxlPixelFormat format_extra;
-
-        m_input_pixel_format.num_channels = 3;
-        m_input_pixel_format.data_type = JXL_TYPE_UINT8;
-        m_input_pixel_format.endianness = JXL_NATIVE_ENDIAN;
-        m_input_pixel_format.align = 0;
-
-        format_extra.num_channels = 1;
-        format_extra.data_type = JXL_TYPE_UINT8;
-        format_extra.endianness = JXL_NATIVE_ENDIAN;
-        format_extra.align = 0;
-
-        const size_t extra_buffer_size = size_t(m_basicinfo.xsize) * size_t(m_basicinfo.ysize);
-        const size_t cmy_buffer_size = extra_buffer_size * 3;
-
-        if (m_basicinfo.alpha_bits > 0) { // CMYK + alpha
-            QImage tmp_cmyk_image = imageAlloc(m_basicinfo.xsize, m_basicinfo.ysize, QImage::Format_CMYK8888);
-            if (tmp_cmyk_image.isNull()) {
-                qWarning("Memory cannot be allocated");
-                m_parseState = ParseJpegXLError;
-                return false;
-            }
-
-            tmp_cmyk_image.setColorSpace(m_colorspace);
-
-            uchar *pixels_alpha = reinterpret_cast<uchar *>(malloc(extra_buffer_size));
-            if (!pixels_alpha) {
-                qWarning("Memory cannot be allocated for ALPHA channel");
-                m_parseState = ParseJpegXLError;
-                return false;
-            }
-
-            pixels_cmy = reinterpret_cast<uchar *>(malloc(cmy_buffer_size));
-            if (!pixels_cmy) {
-                free(pixels_alpha);
-                pixels_alpha = nullptr;
-                qWarning("Memory cannot be allocated for CMY buffer");
-                m_parseState = ParseJpegXLError;
-                return false;
-            }
-
-            pixels_black = reinterpret_cast<uchar *>(malloc(extra_buffer_size));
-            if (!pixels_black) {
-                free(pixels_cmy);
-                pixels_cmy = nullptr;
-                free(pixels_alpha);
-                pixels_alpha = nullptr;
-                qWarning("Memory cannot be allocated for BLACK buffer");
-                m_parseState = ParseJpegXLError;
-                return false;
-            }
-
-            if (JxlDecoderSetImageOutBuffer(m_decoder, &m_input_pixel_format, pixels_cmy, cmy_buffer_size) != JXL_DEC_SUCCESS) {
-                free(pixels_black);
-                pixels_black = nullptr;
-                free(pixels_cmy);
-                pixels_cmy = nullptr;
-                free(pixels_alpha);
-                pixels_alpha = nullptr;
-                qWarning("ERROR: JxlDecoderSetImageOutBuffer failed");
-                m_parseState = ParseJpegXLError;
-                return false;
-            }
-
-            if (JxlDecoderSetExtraChannelBuffer(m_decoder, &format_extra, pixels_black, extra_buffer_size, m_cmyk_channel_id) != JXL_DEC_SUCCESS) {
-                free(pixels_black);
-                pixels_black = nullptr;
-                free(pixels_cmy);
-                pixels_cmy = nullptr;
-                free(pixels_alpha);
-                pixels_alpha = nullptr;
-                qWarning("ERROR: JxlDecoderSetExtraChannelBuffer failed");
-                m_parseState = ParseJpegXLError;
-                return false;
-            }
-
-            if (JxlDecoderSetExtraChannelBuffer(m_decoder, &format_extra, pixels_alpha, extra_buffer_size, m_alpha_channel_id) != JXL_DEC_SUCCESS) {
-                free(pixels_black);
-                pixels_black = nullptr;
-                free(pixels_cmy);
-                pixels_cmy = nullptr;
-                free(pixels_alpha);
-                pixels_alpha = nullptr;
-                qWarning("ERROR: JxlDecoderSetExtraChannelBuffer failed");
-                m_parseState = ParseJpegXLError;
-                return false;
-            }
-
-            status = JxlDecoderProcessInput(m_decoder);
-            if (status != JXL_DEC_FULL_IMAGE) {
-                free(pixels_black);
-                pixels_black = nullptr;
-                free(pixels_cmy);
-                pixels_cmy = nullptr;
-                free(pixels_alpha);
-                pixels_alpha = nullptr;
-                qWarning("Unexpected event %d instead of JXL_DEC_FULL_IMAGE", status);
-                m_parseState = ParseJpegXLError;
-                return false;
-            }
-
-            const uchar *src_CMY = pixels_cmy;
-            const uchar *src_K = pixels_black;
-            for (int y = 0; y < tmp_cmyk_image.height(); y++) {
-                uchar *write_pointer = tmp_cmyk_image.scanLine(y);
-                for (int x = 0; x < tmp_cmyk_image.width(); x++) {
-                    *write_pointer = 255 - *src_CMY; // C
-                    write_pointer++;
-                    src_CMY++;
-                    *write_pointer = 255 - *src_CMY; // M
-                    write_pointer++;
-                    src_CMY++;
-                    *write_pointer = 255 - *src_CMY; // Y
-                    write_pointer++;
-                    src_CMY++;
-                    *write_pointer = 255 - *src_K; // K
-                    write_pointer++;
-                    src_K++;
-                }
-            }
-
-            free(pixels_black);
-            pixels_black = nullptr;
-            free(pixels_cmy);
-            pixels_cmy = nullptr;
-
-            m_current_image = tmp_cmyk_image.convertedToColorSpace(QColorSpace(QColorSpace::SRgb), QImage::Format_ARGB32);
-            if (m_current_image.isNull()) {
-                free(pixels_alpha);
-                pixels_alpha = nullptr;
-                qWarning("ERROR: convertedToColorSpace returned empty image");
-                m_parseState = ParseJpegXLError;
-                return false;
-            }
-
-            // set alpha channel into ARGB image
-            const uchar *src_alpha = pixels_alpha;
-            for (int y = 0; y < m_current_image.height(); y++) {
-                uchar *write_pointer = m_current_image.scanLine(y);
-                for (int x = 0; x < m_current_image.width(); x++) {
-#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
-                    write_pointer += 3; // skip BGR
-                    *write_pointer = *src_alpha; // A
-                    write_pointer++;
-                    src_alpha++;
-#else
-                    *write_pointer = *src_alpha;
-                    write_pointer += 4; // move 4 bytes (skip RGB)
-                    src_alpha++;
-#endif
-                }
-            }
-
-            free(pixels_alpha);
-            pixels_alpha = nullptr;
-        } else { // CMYK (no alpha)
-            m_current_image = imageAlloc(m_basicinfo.xsize, m_basicinfo.ysize, QImage::Format_CMYK8888);
-            if (m_current_image.isNull()) {
-                qWarning("Memory cannot be allocated");
-                m_parseState = ParseJpegXLError;
-                return false;
+    if (const QImage *cached_frame = m_frame_cache.object(m_currentimage_index)) {
+        m_current_image = *cached_frame;
+        m_dirty_rect = QRect();
+
+        if (m_prefetcher) {
+            if (m_frame_cache.count() == m_framedelays.count()) {
+                // every frame is cached, nothing is left to decode in the background
+                retirePrefetch();
+            } else if (m_prefetcher->nextFrame() == m_currentimage_index) {
+                m_prefetcher->skip();
             }
+        }
+        return finish_frame();
+    }
 
-            m_current_image.setColorSpace(m_colorspace);
+    if (m_prefetcher) {
+        QImage frame;
+        if (m_prefetcher->nextFrame() == m_currentimage_index && m_prefetcher->take(&frame)) {
+            m_current_image = frame;
+            m_dirty_rect = QRect();
+            cacheCurrentFrame();
+            return finish_frame();
+        }
 
-            pixels_cmy = reinterpret_cast<uchar *>(malloc(cmy_buffer_size));
-            if (!pixels_cmy) {
-                qWarning("Memory cannot be allocated for CMY buffer");
-                m_parseState = ParseJpegXLError;
-                return false;
-            }
+        // seek to another frame, or the background decoding failed
+        retirePrefetch();
+    }
 
-            pixels_black = reinterpret_cast<uchar *>(malloc(extra_buffer_size));
-            if (!pixels_black) {
-                free(pixels_cmy);
-                pixels_cmy = nullptr;
-                qWarning("Memory cannot be allocated for BLACK buffer");
-                m_parseState = ParseJpegXLError;
-                return false;
-            }
+    if (m_decode_mode != wantedDecodeMode()) {
+        // ScaledSize or ClipRect was changed after the decoder has been set up
+        if (!rewind()) {
+            return false;
+        }
+    }
 
-            if (JxlDecoderSetImageOutBuffer(m_decoder, &m_input_pixel_format, pixels_cmy, cmy_buffer_size) != JXL_DEC_SUCCESS) {
-                free(pixels_black);
-                pixels_black = nullptr;
-                free(pixels_cmy);
-                pixels_cmy = nullptr;
-                qWarning("ERROR: JxlDecoderSetImageOutBuffer failed");
-                m_parseState = ParseJpegXLError;
-                return false;
-            }
+    if (!admitDecoding()) {
+        return false;
+    }
 
-            if (JxlDecoderSetExtraChannelBuffer(m_decoder, &format_extra, pixels_black, extra_buffer_size, m_cmyk_channel_id) != JXL_DEC_SUCCESS) {
-                free(pixels_black);
-                pixels_black = nullptr;
-                free(pixels_cmy);
-                pixels_cmy = nullptr;
-                qWarning("ERROR: JxlDecoderSetExtraChannelBuffer failed");
-                m_parseState = ParseJpegXLError;
-                return false;
-            }
+    if (m_layer_mode) {
+        if (!composeFrame(m_currentimage_index)) {
+            return false;
+        }
 
-            status = JxlDecoderProcessInput(m_decoder);
-            if (status != JXL_DEC_FULL_IMAGE) {
-                free(pixels_black);
-                pixels_black = nullptr;
-                free(pixels_cmy);
-                pixels_cmy = nullptr;
-                qWarning("Unexpected event %d instead of JXL_DEC_FULL_IMAGE", status);
-                m_parseState = ParseJpegXLError;
-                return false;
-            }
+        if (decodedRect() != fullRect()) {
+            m_current_image = m_current_image.copy(decodedRect());
+        }
+        return complete_frame();
+    }
 
-            const uchar *src_CMY = pixels_cmy;
-            const uchar *src_K = pixels_black;
-            for (int y = 0; y < m_current_image.height(); y++) {
-                uchar *write_pointer = m_current_image.scanLine(y);
-                for (int x = 0; x < m_current_image.width(); x++) {
-                    *write_pointer = 255 - *src_CMY; // C
-                    write_pointer++;
-                    src_CMY++;
-                    *write_pointer = 255 - *src_CMY; // M
-                    write_pointer++;
-                    src_CMY++;
-                    *write_pointer = 255 - *src_CMY; // Y
-                    write_pointer++;
-                    src_CMY++;
-                    *write_pointer = 255 - *src_K; // K
-                    write_pointer++;
-                    src_K++;
-                }
-            }
+    if (!seekDecoder(m_currentimage_index)) {
+        return false;
+    }
 
-            free(pixels_black);
-            pixels_black = nullptr;
-            free(pixels_cmy);
-            pixels_cmy = nullptr;
+    JxlDecoderStatus status = processInput();
+    if (m_decode_mode == DecodePreview) {
+        if (status != JXL_DEC_NEED_PREVIEW_OUT_BUFFER) {
+            qWarning("Unexpected event %d instead of JXL_DEC_NEED_PREVIEW_OUT_BUFFER", status);
+            m_parseState = ParseJpegXLError;
+            return false;
         }
-#else
-        // CMYK not supported in older Qt
+    } else if (status != JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+        qWarning("Unexpected event %d instead of JXL_DEC_NEED_IMAGE_OUT_BUFFER", status);
         m_parseState = ParseJpegXLError;
         return false;
-#endif
-    } else { // RGB or GRAY
-        m_current_image = imageAlloc(m_basicinfo.xsize, m_basicinfo.ysize, m_input_image_format);
+    }
+    m_decoder_frame_index = m_currentimage_index + 1;
+    m_dirty_rect = QRect();
+
+    if (m_decode_mode == DecodePreview) { // embedded preview instead of the main frame
+        m_current_image = imageAlloc(m_basicinfo.preview.xsize, m_basicinfo.preview.ysize, m_input_image_format);
         if (m_current_image.isNull()) {
             qWarning("Memory cannot be allocated");
             m_parseState = ParseJpegXLError;
@@ -751,34 +1181,23 @@ bool QJpegXLHandler::decode_one_frame()
 
         m_input_pixel_format.align = m_current_image.bytesPerLine();
 
-        size_t rgb_buffer_size = size_t(m_current_image.height() - 1) * size_t(m_current_image.bytesPerLine());
-        switch (m_input_pixel_format.data_type) {
-        case JXL_TYPE_FLOAT:
-            rgb_buffer_size += 4 * size_t(m_input_pixel_format.num_channels) * size_t(m_current_image.width());
-            break;
-        case JXL_TYPE_UINT8:
-            rgb_buffer_size += size_t(m_input_pixel_format.num_channels) * size_t(m_current_image.width());
-            break;
-        case JXL_TYPE_UINT16:
-        case JXL_TYPE_FLOAT16:
-            rgb_buffer_size += 2 * size_t(m_input_pixel_format.num_channels) * size_t(m_current_image.width());
-            break;
-        default:
-            qWarning("ERROR: unsupported data type");
+        size_t preview_buffer_size = 0;
+        if (JxlDecoderPreviewOutBufferSize(m_decoder, &m_input_pixel_format, &preview_buffer_size) != JXL_DEC_SUCCESS
+            || preview_buffer_size > size_t(m_current_image.sizeInBytes())) {
+            qWarning("ERROR: unexpected size of JXL preview buffer");
             m_parseState = ParseJpegXLError;
             return false;
-            break;
         }
 
-        if (JxlDecoderSetImageOutBuffer(m_decoder, &m_input_pixel_format, m_current_image.bits(), rgb_buffer_size) != JXL_DEC_SUCCESS) {
-            qWarning("ERROR: JxlDecoderSetImageOutBuffer failed");
+        if (JxlDecoderSetPreviewOutBuffer(m_decoder, &m_input_pixel_format, m_current_image.bits(), preview_buffer_size) != JXL_DEC_SUCCESS) {
+            qWarning("ERROR: JxlDecoderSetPreviewOutBuffer failed");
             m_parseState = ParseJpegXLError;
             return false;
         }
 
-        status = JxlDecoderProcessInput(m_decoder);
-        if (status != JXL_DEC_FULL_IMAGE) {
-            qWarning("Unexpected event %d instead of JXL_DEC_FULL_IMAGE", status);
+        status = processInput();
+        if (status != JXL_DEC_PREVIEW_IMAGE) {
+            qWarning("Unexpected event %d instead of JXL_DEC_PREVIEW_IMAGE", status);
             m_parseState = ParseJpegXLError;
             return false;
         }
@@ -786,20 +1205,383 @@ bool QJpegXLHandler::decode_one_frame()
         if (m_target_image_format != m_input_image_format) {
             m_current_image.convertTo(m_target_image_format);
         }
-    }
 
-    m_next_image_delay = m_framedelays[m_currentimage_index];
-    m_previousimage_index = m_currentimage_index;
+        if (!rewind()) { // the main frame is not needed
+            return false;
+        }
+    } else if (m_isCMYK) { // CMYK decoding
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+        const QRect region = decodedRect();
+        if (region.isEmpty()) {
+            qWarning("ClipRect is outside of the JXL image");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
 
-    if (m_framedelays.count() > 1) {
-        m_currentimage_index++;
+        const bool has_alpha = m_basicinfo.alpha_bits > 0;
 
-        if (m_currentimage_index >= m_framedelays.count()) {
-            if (!rewind()) {
-                return false;
+        /* CMY (and alpha) arrive through the callback straight into the destination image,
+         * only the BLACK channel needs its own plane. */
+        m_current_image = imageAlloc(region.width(), region.height(), has_alpha ? QImage::Format_ARGB32 : QImage::Format_CMYK8888);
+        if (m_current_image.isNull()) {
+            qWarning("Memory cannot be allocated");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        JxlPixelFormat format_extra;
+
+        m_input_pixel_format.num_channels = has_alpha ? 4 : 3;
+        m_input_pixel_format.data_type = JXL_TYPE_UINT8;
+        m_input_pixel_format.endianness = JXL_NATIVE_ENDIAN;
+        m_input_pixel_format.align = 0;
+
+        format_extra.num_channels = 1;
+        format_extra.data_type = JXL_TYPE_UINT8;
+        format_extra.endianness = JXL_NATIVE_ENDIAN;
+        format_extra.align = 0;
+
+        const size_t extra_buffer_size = size_t(m_basicinfo.xsize) * size_t(m_basicinfo.ysize);
+
+        uchar *pixels_black = reinterpret_cast<uchar *>(m_memory.allocate(extra_buffer_size));
+        if (!pixels_black) {
+            qWarning("Memory cannot be allocated for BLACK buffer");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        JxlCmykSink sink;
+        sink.bits = m_current_image.bits();
+        sink.bytes_per_line = m_current_image.bytesPerLine();
+        sink.num_channels = m_input_pixel_format.num_channels;
+        sink.left = region.x();
+        sink.top = region.y();
+        sink.width = region.width();
+        sink.height = region.height();
+
+        if (JxlDecoderSetImageOutCallback(m_decoder, &m_input_pixel_format, cmykCallback, &sink) != JXL_DEC_SUCCESS) {
+            m_memory.release(pixels_black);
+            pixels_black = nullptr;
+            qWarning("ERROR: JxlDecoderSetImageOutCallback failed");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        if (JxlDecoderSetExtraChannelBuffer(m_decoder, &format_extra, pixels_black, extra_buffer_size, m_cmyk_channel_id) != JXL_DEC_SUCCESS) {
+            m_memory.release(pixels_black);
+            pixels_black = nullptr;
+            qWarning("ERROR: JxlDecoderSetExtraChannelBuffer failed");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        status = processInput();
+        if (status != JXL_DEC_FULL_IMAGE) {
+            m_memory.release(pixels_black);
+            pixels_black = nullptr;
+            qWarning("Unexpected event %d instead of JXL_DEC_FULL_IMAGE", status);
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        const QColorSpace srgb_colorspace(QColorSpace::SRgb);
+
+        JxlCmykStrips strips;
+        strips.bits = m_current_image.bits();
+        strips.bytes_per_line = m_current_image.bytesPerLine();
+        strips.width = m_current_image.width();
+        strips.black = pixels_black + size_t(region.y()) * m_basicinfo.xsize + region.x();
+        strips.black_stride = m_basicinfo.xsize;
+        strips.has_alpha = has_alpha;
+        if (has_alpha) {
+            strips.transform = m_colorspace.transformationToColorSpace(srgb_colorspace);
+        }
+
+        if (!QJpegXLColorConverter::forEachStrip(&m_runner, m_current_image.height(), cmykStrip, &strips)) {
+            m_memory.release(pixels_black);
+            pixels_black = nullptr;
+            qWarning("ERROR: CMYK to sRGB conversion failed");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        m_memory.release(pixels_black);
+        pixels_black = nullptr;
+
+        m_current_image.setColorSpace(has_alpha ? srgb_colorspace : m_colorspace);
+#else
+        // CMYK not supported in older Qt
+        m_parseState = ParseJpegXLError;
+        return false;
+#endif
+    } else if (m_decode_mode == DecodeDCOnly) { // thumbnail, one pixel per 8x8 block of the frame
+        const JxlPixelConversion conversion = pixelConversion(m_input_image_format, m_target_image_format);
+        const QImage::Format decoded_format = (conversion == PixelsConvertedAfterwards) ? m_input_image_format : m_target_image_format;
+        const QRect region = decodedRect();
+        if (region.isEmpty()) {
+            qWarning("ClipRect is outside of the JXL image");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        m_current_image = imageAlloc((region.width() + kDCDownsamplingRatio - 1) / kDCDownsamplingRatio,
+                                     (region.height() + kDCDownsamplingRatio - 1) / kDCDownsamplingRatio,
+                                     decoded_format);
+        if (m_current_image.isNull()) {
+            qWarning("Memory cannot be allocated");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        m_current_image.setColorSpace(m_colorspace);
+
+        std::vector<QMutex> row_locks(m_current_image.height());
+
+        JxlBlockSink sink;
+        sink.data_type = m_input_pixel_format.data_type;
+        sink.bytes_per_sample = bytesPerPixel(m_input_pixel_format) / m_input_pixel_format.num_channels;
+        sink.num_channels = m_input_pixel_format.num_channels;
+        sink.left = region.x();
+        sink.top = region.y();
+        sink.width = region.width();
+        sink.height = region.height();
+        sink.step = kDCDownsamplingRatio;
+        sink.blocks_per_row = m_current_image.width();
+        sink.sums.assign(sink.blocks_per_row * size_t(m_current_image.height()) * sink.num_channels, 0.0f);
+        sink.row_locks = row_locks.data();
+
+        if (JxlDecoderSetImageOutCallback(m_decoder, &m_input_pixel_format, blockCallback, &sink) != JXL_DEC_SUCCESS) {
+            qWarning("ERROR: JxlDecoderSetImageOutCallback failed");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        // without the DC pass (modular images, refused flush), the whole frame is averaged
+        bool flushed = false;
+        for (status = processInput(); status == JXL_DEC_FRAME_PROGRESSION; status = processInput()) {
+            // the flush delivers every pixel, the rows received before are put aside
+            std::vector<float> received_sums(sink.sums.size(), 0.0f);
+            received_sums.swap(sink.sums);
+            if (JxlDecoderFlushImage(m_decoder) == JXL_DEC_SUCCESS) {
+                flushed = true;
+                break;
             }
+            received_sums.swap(sink.sums);
+        }
+
+        if (!flushed && status != JXL_DEC_FULL_IMAGE) {
+            qWarning("Unexpected event %d instead of JXL_DEC_FULL_IMAGE", status);
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        storeBlocks(&sink, conversion, &m_current_image);
+
+        if (m_current_image.format() != m_target_image_format) {
+            m_current_image.convertTo(m_target_image_format);
+        }
+
+        if (flushed && !rewind()) { // the rest of the frame is not needed
+            return false;
+        }
+    } else if (decodedRect() != fullRect() || swizzledWhileDecoding(pixelConversion(m_input_image_format, m_target_image_format))) {
+        // RGB or GRAY region of interest, or 8-bit RGB swizzled into the target format
+        const JxlPixelConversion conversion = pixelConversion(m_input_image_format, m_target_image_format);
+        const QImage::Format decoded_format = (conversion == PixelsConvertedAfterwards) ? m_input_image_format : m_target_image_format;
+        const QRect region = decodedRect();
+        if (region.isEmpty()) {
+            qWarning("ClipRect is outside of the JXL image");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        m_current_image = imageAlloc(region.width(), region.height(), decoded_format);
+        if (m_current_image.isNull()) {
+            qWarning("Memory cannot be allocated");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        m_current_image.setColorSpace(m_colorspace);
+
+        JxlRegionSink sink;
+        sink.bits = m_current_image.bits();
+        sink.bytes_per_line = m_current_image.bytesPerLine();
+        sink.bytes_per_pixel = bytesPerPixel(m_input_pixel_format);
+        sink.conversion = conversion;
+        sink.left = region.x();
+        sink.top = region.y();
+        sink.width = region.width();
+        sink.height = region.height();
+
+        if (JxlDecoderSetImageOutCallback(m_decoder, &m_input_pixel_format, regionCallback, &sink) != JXL_DEC_SUCCESS) {
+            qWarning("ERROR: JxlDecoderSetImageOutCallback failed");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        status = processInput();
+        if (status != JXL_DEC_FULL_IMAGE) {
+            qWarning("Unexpected event %d instead of JXL_DEC_FULL_IMAGE", status);
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        if (m_current_image.format() != m_target_image_format) {
+            m_current_image.convertTo(m_target_image_format);
+        }
+    } else { // RGB or GRAY
+        // RGBA64 and RGBA FP layouts match their RGBX targets, libjxl fills the missing alpha as opaque
+        const bool same_layout = pixelConversion(m_input_image_format, m_target_image_format) == PixelsCopied;
+        m_current_image = imageAlloc(m_basicinfo.xsize, m_basicinfo.ysize, same_layout ? m_target_image_format : m_input_image_format);
+        if (m_current_image.isNull()) {
+            qWarning("Memory cannot be allocated");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        m_current_image.setColorSpace(m_colorspace);
+
+        m_input_pixel_format.align = m_current_image.bytesPerLine();
+
+        size_t rgb_buffer_size = size_t(m_current_image.height() - 1) * size_t(m_current_image.bytesPerLine());
+        switch (m_input_pixel_format.data_type) {
+        case JXL_TYPE_FLOAT:
+            rgb_buffer_size += 4 * size_t(m_input_pixel_format.num_channels) * size_t(m_current_image.width());
+            break;
+        case JXL_TYPE_UINT8:
+            rgb_buffer_size += size_t(m_input_pixel_format.num_channels) * size_t(m_current_image.width());
+            break;
+        case JXL_TYPE_UINT16:
+        case JXL_TYPE_FLOAT16:
+            rgb_buffer_size += 2 * size_t(m_input_pixel_format.num_channels) * size_t(m_current_image.width());
+            break;
+        default:
+            qWarning("ERROR: unsupported data type");
+            m_parseState = ParseJpegXLError;
+            return false;
+            break;
+        }
+
+        if (JxlDecoderSetImageOutBuffer(m_decoder, &m_input_pixel_format, m_current_image.bits(), rgb_buffer_size) != JXL_DEC_SUCCESS) {
+            qWarning("ERROR: JxlDecoderSetImageOutBuffer failed");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        status = processInput();
+        if (status != JXL_DEC_FULL_IMAGE) {
+            qWarning("Unexpected event %d instead of JXL_DEC_FULL_IMAGE", status);
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        if (m_current_image.format() != m_target_image_format) {
+            m_current_image.convertTo(m_target_image_format);
+        }
+    }
+
+    return complete_frame();
+}
+
+bool QJpegXLHandler::complete_frame()
+{
+    if (m_scaled_size.isValid() && !m_scaled_size.isEmpty() && m_current_image.size() != m_scaled_size) {
+        m_current_image = m_current_image.scaled(m_scaled_size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        if (m_current_image.isNull()) {
+            qWarning("ERROR: JXL image cannot be scaled");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+    }
+
+    cacheCurrentFrame();
+    startPrefetch();
+
+    return finish_frame();
+}
+
+void QJpegXLHandler::cacheCurrentFrame()
+{
+    if (m_framedelays.count() > 1 && m_frame_cache.maxCost() > 0) {
+        const qsizetype cost = m_current_image.sizeInBytes() / 1024 + 1;
+        if (cost <= m_frame_cache.maxCost()) {
+            m_frame_cache.insert(m_currentimage_index, new QImage(m_current_image), int(cost));
+        }
+    }
+}
+
+void QJpegXLHandler::startPrefetch()
+{
+    // the background decoder needs its own access to the data, a device cannot be shared
+    if (m_prefetch_depth < 1 || m_framedelays.count() < 2 || m_input_mode == InputStreamed || m_frame_cache.count() == m_framedelays.count()) {
+        return;
+    }
+
+    const int next_frame = (m_currentimage_index + 1) % m_framedelays.count();
+    if (m_prefetcher && m_prefetcher->nextFrame() == next_frame) {
+        return; // already decoding the following frames
+    }
+
+    QByteArray data;
+    if (m_input_mode == InputMapped) {
+        if (!isMappingValid()) {
+            return;
+        }
+        // releaseMapping() stops the prefetcher before the data is unmapped
+        data = QByteArray::fromRawData(reinterpret_cast<const char *>(m_mapped_data), m_mapped_size);
+    } else {
+        data = m_rawData;
+    }
+
+    retirePrefetch();
+    m_prefetcher = new QJpegXLPrefetcher(data,
+                                         m_framedelays.count(),
+                                         next_frame,
+                                         m_prefetch_depth,
+                                         m_scaled_size,
+                                         m_clip_rect);
+    m_prefetcher->start();
+}
+
+/* Stops the background decoding without waiting for the frame in progress,
+ * so reading is not blocked. Threads which have finished meanwhile are deleted. */
+void QJpegXLHandler::retirePrefetch()
+{
+    if (m_prefetcher) {
+        m_prefetcher->requestStop();
+        m_retired_prefetchers.append(m_prefetcher);
+        m_prefetcher = nullptr;
+    }
+
+    for (int i = m_retired_prefetchers.count() - 1; i >= 0; i--) {
+        if (m_retired_prefetchers.at(i)->isFinished()) {
+            delete m_retired_prefetchers.takeAt(i);
+        }
+    }
+}
+
+/* Waits for all background threads, they read the data of the handler. */
+void QJpegXLHandler::stopPrefetch()
+{
+    delete m_prefetcher;
+    m_prefetcher = nullptr;
+
+    qDeleteAll(m_retired_prefetchers);
+    m_retired_prefetchers.clear();
+}
+
+bool QJpegXLHandler::finish_frame()
+{
+    m_next_image_delay = m_framedelays[m_currentimage_index];
+    m_previousimage_index = m_currentimage_index;
+
+    if (m_framedelays.count() > 1) {
+        m_currentimage_index++;
 
-            // all frames in animation have been read
+        if (m_currentimage_index >= m_framedelays.count()) {
+            // all frames in animation have been read, the decoder is rewound when needed
+            m_currentimage_index = 0;
             m_parseState = ParseJpegXLFinished;
         } else {
             m_parseState = ParseJpegXLSuccess;
@@ -860,20 +1642,18 @@ bool QJpegXLHandler::write(const QImage &image)
         return false;
     }
 
-    JxlEncoder *encoder = JxlEncoderCreate(nullptr);
+    JxlEncoder *encoder = JxlEncoderCreate(m_memory.jxlMemoryManager());
     if (!encoder) {
         qWarning("Failed to create Jxl encoder");
         return false;
     }
 
-    void *runner = nullptr;
-    int num_worker_threads = qBound(1, QThread::idealThreadCount(), 64);
+    QJpegXLRunner runner;
+    runner.setWorkerThreads(QJpegXLRunner::workerThreadsFor(image.width(), image.height()));
 
-    if (num_worker_threads > 1) {
-        runner = JxlThreadParallelRunnerCreate(nullptr, num_worker_threads);
-        if (JxlEncoderSetParallelRunner(encoder, JxlThreadParallelRunner, runner) != JXL_ENC_SUCCESS) {
+    if (runner.isParallel()) {
+        if (JxlEncoderSetParallelRunner(encoder, QJpegXLRunner::run, &runner) != JXL_ENC_SUCCESS) {
             qWarning("JxlEncoderSetParallelRunner failed");
-            JxlThreadParallelRunnerDestroy(runner);
             JxlEncoderDestroy(encoder);
             return false;
         }
@@ -935,9 +1715,6 @@ bool QJpegXLHandler::write(const QImage &image)
         const QByteArray cmyk_profile = image.colorSpace().iccProfile();
         if (cmyk_profile.isEmpty()) {
             qWarning("ERROR saving CMYK JXL: empty ICC profile");
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
             JxlEncoderDestroy(encoder);
             return false;
         }
@@ -945,9 +1722,6 @@ bool QJpegXLHandler::write(const QImage &image)
         status = JxlEncoderSetBasicInfo(encoder, &output_info);
         if (status != JXL_ENC_SUCCESS) {
             qWarning("JxlEncoderSetBasicInfo for CMYK image failed!");
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
             JxlEncoderDestroy(encoder);
             return false;
         }
@@ -955,9 +1729,6 @@ bool QJpegXLHandler::write(const QImage &image)
         status = JxlEncoderSetExtraChannelInfo(encoder, 0, &extra_black_channel);
         if (status != JXL_ENC_SUCCESS) {
             qWarning("JxlEncoderSetExtraChannelInfo for CMYK image failed!");
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
             JxlEncoderDestroy(encoder);
             return false;
         }
@@ -965,9 +1736,6 @@ bool QJpegXLHandler::write(const QImage &image)
         status = JxlEncoderSetICCProfile(encoder, reinterpret_cast<const uint8_t *>(cmyk_profile.constData()), cmyk_profile.size());
         if (status != JXL_ENC_SUCCESS) {
             qWarning("JxlEncoderSetICCProfile for CMYK image failed!");
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
             JxlEncoderDestroy(encoder);
             return false;
         }
@@ -978,25 +1746,19 @@ bool QJpegXLHandler::write(const QImage &image)
         uchar *pixels_cmy = nullptr;
         uchar *pixels_black = nullptr;
 
-        pixels_cmy = reinterpret_cast<uchar *>(malloc(cmy_buffer_size));
+        pixels_cmy = reinterpret_cast<uchar *>(m_memory.allocate(cmy_buffer_size));
         if (!pixels_cmy) {
             qWarning("Memory cannot be allocated for CMY buffer");
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
             JxlEncoderDestroy(encoder);
             return false;
         }
 
-        pixels_black = reinterpret_cast<uchar *>(malloc(extra_buffer_size));
+        pixels_black = reinterpret_cast<uchar *>(m_memory.allocate(extra_buffer_size));
         if (!pixels_black) {
             qWarning("Memory cannot be allocated for BLACK buffer");
-            free(pixels_cmy);
+            m_memory.release(pixels_cmy);
             pixels_cmy = nullptr;
 
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
             JxlEncoderDestroy(encoder);
             return false;
         }
@@ -1028,36 +1790,27 @@ bool QJpegXLHandler::write(const QImage &image)
         status = JxlEncoderAddImageFrame(frame_settings_lossless, &pixel_format, pixels_cmy, cmy_buffer_size);
         if (status == JXL_ENC_ERROR) {
             qWarning("JxlEncoderAddImageFrame failed!");
-            free(pixels_black);
+            m_memory.release(pixels_black);
             pixels_black = nullptr;
-            free(pixels_cmy);
+            m_memory.release(pixels_cmy);
             pixels_cmy = nullptr;
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
             JxlEncoderDestroy(encoder);
             return false;
         }
 
         status = JxlEncoderSetExtraChannelBuffer(frame_settings_lossless, &format_extra, pixels_black, extra_buffer_size, 0);
 
-        free(pixels_black);
+        m_memory.release(pixels_black);
         pixels_black = nullptr;
-        free(pixels_cmy);
+        m_memory.release(pixels_cmy);
         pixels_cmy = nullptr;
 
         if (status == JXL_ENC_ERROR) {
             qWarning("JxlEncoderSetExtraChannelBuffer failed!");
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
             JxlEncoderDestroy(encoder);
             return false;
         }
 #else
-        if (runner) {
-            JxlThreadParallelRunnerDestroy(runner);
-        }
         JxlEncoderDestroy(encoder);
         return false;
 #endif
@@ -1230,7 +1983,7 @@ bool QJpegXLHandler::write(const QImage &image)
 
                 const QColorSpace gray_profile(gray_whitePoint, gray_trc, gamma_gray);
                 if (gray_profile.isValid()) {
-                    tmpimage = image.convertedToColorSpace(gray_profile, tmpformat);
+                    tmpimage = QJpegXLColorConverter::convertedToColorSpace(image, gray_profile, tmpformat, &runner);
                 } else {
                     qWarning("JXL plugin created invalid grayscale QColorSpace!");
                     tmpimage = image.convertToFormat(tmpformat);
@@ -1254,7 +2007,7 @@ bool QJpegXLHandler::write(const QImage &image)
 
                 const QColorSpace rgb_profile(whitePoint, redP, greenP, blueP, trc_rgb, gamma_rgb);
                 if (rgb_profile.isValid()) {
-                    tmpimage = image.convertedToColorSpace(rgb_profile, tmpformat);
+                    tmpimage = QJpegXLColorConverter::convertedToColorSpace(image, rgb_profile, tmpformat, &runner);
                 } else {
                     qWarning("JXL plugin created invalid RGB QColorSpace!");
                     tmpimage = image.convertToFormat(tmpformat);
@@ -1274,9 +2027,6 @@ bool QJpegXLHandler::write(const QImage &image)
 
         if (output_info.xsize == 0 || output_info.ysize == 0 || tmpimage.isNull()) {
             qWarning("Unable to allocate memory for output image");
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
             JxlEncoderDestroy(encoder);
             return false;
         }
@@ -1395,9 +2145,6 @@ bool QJpegXLHandler::write(const QImage &image)
         status = JxlEncoderSetBasicInfo(encoder, &output_info);
         if (status != JXL_ENC_SUCCESS) {
             qWarning("JxlEncoderSetBasicInfo failed!");
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
             JxlEncoderDestroy(encoder);
             return false;
         }
@@ -1406,9 +2153,6 @@ bool QJpegXLHandler::write(const QImage &image)
             status = JxlEncoderSetICCProfile(encoder, reinterpret_cast<const uint8_t *>(iccprofile.constData()), iccprofile.size());
             if (status != JXL_ENC_SUCCESS) {
                 qWarning("JxlEncoderSetICCProfile failed!");
-                if (runner) {
-                    JxlThreadParallelRunnerDestroy(runner);
-                }
                 JxlEncoderDestroy(encoder);
                 return false;
             }
@@ -1416,9 +2160,6 @@ bool QJpegXLHandler::write(const QImage &image)
             status = JxlEncoderSetColorEncoding(encoder, &color_profile);
             if (status != JXL_ENC_SUCCESS) {
                 qWarning("JxlEncoderSetColorEncoding failed!");
-                if (runner) {
-                    JxlThreadParallelRunnerDestroy(runner);
-                }
                 JxlEncoderDestroy(encoder);
                 return false;
             }
@@ -1439,9 +2180,10 @@ bool QJpegXLHandler::write(const QImage &image)
         if (tmpimage.format() == QImage::Format_RGBX32FPx4) { // pack 32-bit depth RGBX -> RGB
             buffer_size = 12 * size_t(tmpimage.width()) * size_t(tmpimage.height());
 
-            float *packed_pixels32 = reinterpret_cast<float *>(malloc(buffer_size));
+            float *packed_pixels32 = reinterpret_cast<float *>(m_memory.allocate(buffer_size));
             if (!packed_pixels32) {
                 qWarning("ERROR: JXL plug-in failed to allocate memory");
+                JxlEncoderDestroy(encoder);
                 return false;
             }
 
@@ -1462,7 +2204,7 @@ bool QJpegXLHandler::write(const QImage &image)
             }
 
             status = JxlEncoderAddImageFrame(encoder_options, &pixel_format, packed_pixels32, buffer_size);
-            free(packed_pixels32);
+            m_memory.release(packed_pixels32);
         } else if (tmpimage.format() == QImage::Format_RGBX16FPx4 || tmpimage.format() == QImage::Format_RGBX64) {
 #else
         if (tmpimage.format() == QImage::Format_RGBX64) {
@@ -1470,9 +2212,10 @@ bool QJpegXLHandler::write(const QImage &image)
             // pack 16-bit depth RGBX -> RGB
             buffer_size = 6 * size_t(tmpimage.width()) * size_t(tmpimage.height());
 
-            quint16 *packed_pixels16 = reinterpret_cast<quint16 *>(malloc(buffer_size));
+            quint16 *packed_pixels16 = reinterpret_cast<quint16 *>(m_memory.allocate(buffer_size));
             if (!packed_pixels16) {
                 qWarning("ERROR: JXL plug-in failed to allocate memory");
+                JxlEncoderDestroy(encoder);
                 return false;
             }
 
@@ -1493,7 +2236,7 @@ bool QJpegXLHandler::write(const QImage &image)
             }
 
             status = JxlEncoderAddImageFrame(encoder_options, &pixel_format, packed_pixels16, buffer_size);
-            free(packed_pixels16);
+            m_memory.release(packed_pixels16);
         } else { // use QImage's data directly
             pixel_format.align = tmpimage.bytesPerLine();
 
@@ -1520,9 +2263,6 @@ bool QJpegXLHandler::write(const QImage &image)
 
         if (status == JXL_ENC_ERROR) {
             qWarning("JxlEncoderAddImageFrame failed!");
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
             JxlEncoderDestroy(encoder);
             return false;
         }
@@ -1530,47 +2270,9 @@ bool QJpegXLHandler::write(const QImage &image)
 
     JxlEncoderCloseInput(encoder);
 
-    std::vector<uint8_t> compressed;
-    compressed.resize(4096);
-    size_t offset = 0;
-    uint8_t *next_out;
-    size_t avail_out;
-    do {
-        next_out = compressed.data() + offset;
-        avail_out = compressed.size() - offset;
-        status = JxlEncoderProcessOutput(encoder, &next_out, &avail_out);
-
-        if (status == JXL_ENC_NEED_MORE_OUTPUT) {
-            offset = next_out - compressed.data();
-            compressed.resize(compressed.size() * 2);
-        } else if (status == JXL_ENC_ERROR) {
-            qWarning("JxlEncoderProcessOutput failed!");
-            if (runner) {
-                JxlThreadParallelRunnerDestroy(runner);
-            }
-            JxlEncoderDestroy(encoder);
-            return false;
-        }
-    } while (status != JXL_ENC_SUCCESS);
-
-    if (runner) {
-        JxlThreadParallelRunnerDestroy(runner);
-    }
+    const bool written = QJpegXLEncoderOutput::write(encoder, device());
     JxlEncoderDestroy(encoder);
-
-    compressed.resize(next_out - compressed.data());
-
-    if (compressed.size() > 0) {
-        qint64 write_status = device()->write(reinterpret_cast<const char *>(compressed.data()), compressed.size());
-
-        if (write_status > 0) {
-            return true;
-        } else if (write_status == -1) {
-            qWarning("Write error: %s\n", qUtf8Printable(device()->errorString()));
-        }
-    }
-
-    return false;
+    return written;
 }
 
 QVariant QJpegXLHandler::option(ImageOption option) const
@@ -1579,13 +2281,37 @@ QVariant QJpegXLHandler::option(ImageOption option) const
         return m_quality;
     }
 
-    if (!supportsOption(option) || !ensureParsed()) {
+    if (!supportsOption(option) || !ensureBasicInfo()) {
         return QVariant();
     }
 
     switch (option) {
     case Size:
         return QSize(m_basicinfo.xsize, m_basicinfo.ysize);
+    case ScaledSize:
+        return m_scaled_size;
+    case ClipRect:
+        return m_clip_rect;
+    case ImageFormat:
+        if (formatNeedsColorInfo() && !ensureALLCounted()) {
+            return QVariant();
+        }
+        if (formatMayFallBackToEightBits()) {
+            // admitDecoding() makes the same choice as read() does, so both report the same format
+            if (!ensureALLCounted() || !const_cast<QJpegXLHandler *>(this)->admitDecoding()) {
+                return QVariant();
+            }
+        }
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+        if (m_isCMYK) {
+            return (m_basicinfo.alpha_bits > 0) ? QImage::Format_ARGB32 : QImage::Format_CMYK8888;
+        }
+#endif
+        if (m_target_image_format == QImage::Format_Invalid) {
+            // the same choice as countALLFrames() makes later
+            const_cast<QJpegXLHandler *>(this)->selectFormats();
+        }
+        return m_target_image_format;
     case Animation:
         if (m_basicinfo.have_animation) {
             return true;
@@ -1608,6 +2334,16 @@ void QJpegXLHandler::setOption(ImageOption option, const QVariant &value)
             m_quality = 90;
         }
         return;
+    case ScaledSize:
+        m_scaled_size = value.toSize();
+        m_frame_cache.clear();
+        retirePrefetch();
+        return;
+    case ClipRect:
+        m_clip_rect = value.toRect();
+        m_frame_cache.clear();
+        retirePrefetch();
+        return;
     default:
         break;
     }
@@ -1616,7 +2352,7 @@ void QJpegXLHandler::setOption(ImageOption option, const QVariant &value)
 
 bool QJpegXLHandler::supportsOption(ImageOption option) const
 {
-    return option == Quality || option == Size || option == Animation;
+    return option == Quality || option == Size || option == ScaledSize || option == ClipRect || option == ImageFormat || option == Animation;
 }
 
 int QJpegXLHandler::imageCount() const
@@ -1664,11 +2400,7 @@ bool QJpegXLHandler::jumpToNextImage()
         m_currentimage_index++;
 
         if (m_currentimage_index >= m_framedelays.count()) {
-            if (!rewind()) {
-                return false;
-            }
-        } else {
-            JxlDecoderSkipFrames(m_decoder, 1);
+            m_currentimage_index = 0;
         }
     }
 
@@ -1691,24 +2423,11 @@ bool QJpegXLHandler::jumpToImage(int imageNumber)
         return true;
     }
 
-    if (imageNumber > m_currentimage_index) {
-        JxlDecoderSkipFrames(m_decoder, imageNumber - m_currentimage_index);
-        m_currentimage_index = imageNumber;
-        m_parseState = ParseJpegXLSuccess;
-        return true;
-    }
-
-    if (!rewind()) {
-        return false;
-    }
-
-    if (imageNumber > 0) {
-        JxlDecoderSkipFrames(m_decoder, imageNumber);
-    }
-    m_currentimage_index = imageNumber;
-    m_parseState = ParseJpegXLSuccess;
-    return true;
-}
+    // the decoder is moved to the frame when it is not found in the frame cache
+    m_currentimage_index = imageNumber;
+    m_parseState = ParseJpegXLSuccess;
+    return true;
+}
 
 int QJpegXLHandler::nextImageDelay() const
 {
@@ -1723,9 +2442,26 @@ int QJpegXLHandler::nextImageDelay() const
     return m_next_image_delay;
 }
 
+QRect QJpegXLHandler::currentImageRect() const
+{
+    if (!m_dirty_rect.isValid()) {
+        return QRect();
+    }
+
+    // area of the last read frame which changed since the previous one, in coordinates of the returned image
+    const QRect region = decodedRect();
+    QRect rect = m_dirty_rect.intersected(region).translated(-region.topLeft());
+    if (m_scaled_size.isValid() && !m_scaled_size.isEmpty() && m_scaled_size != region.size()) {
+        const qreal sx = qreal(m_scaled_size.width()) / region.width();
+        const qreal sy = qreal(m_scaled_size.height()) / region.height();
+        rect = QRectF(rect.x() * sx, rect.y() * sy, rect.width() * sx, rect.height() * sy).toAlignedRect().intersected(QRect(QPoint(0, 0), m_scaled_size));
+    }
+    return rect;
+}
+
 int QJpegXLHandler::loopCount() const
 {
-    if (!ensureParsed()) {
+    if (!ensureBasicInfo()) {
         return 0;
     }
 
@@ -1738,40 +2474,60 @@ int QJpegXLHandler::loopCount() const
 
 bool QJpegXLHandler::rewind()
 {
-    m_currentimage_index = 0;
+    m_decoder_frame_index = 0;
+    for (QImage &slot : m_reference_slots) {
+        slot = QImage();
+    }
 
     JxlDecoderReleaseInput(m_decoder);
     JxlDecoderRewind(m_decoder);
-    if (m_runner) {
-        if (JxlDecoderSetParallelRunner(m_decoder, JxlThreadParallelRunner, m_runner) != JXL_DEC_SUCCESS) {
+
+    m_runner.setWorkerThreads(QJpegXLRunner::workerThreadsFor(m_basicinfo.xsize, m_basicinfo.ysize));
+    if (m_runner.isParallel()) {
+        if (JxlDecoderSetParallelRunner(m_decoder, QJpegXLRunner::run, &m_runner) != JXL_DEC_SUCCESS) {
             qWarning("ERROR: JxlDecoderSetParallelRunner failed");
             m_parseState = ParseJpegXLError;
             return false;
         }
     }
 
-    if (JxlDecoderSetInput(m_decoder, reinterpret_cast<const uint8_t *>(m_rawData.constData()), m_rawData.size()) != JXL_DEC_SUCCESS) {
-        qWarning("ERROR: JxlDecoderSetInput failed");
+    if (!resetInput()) {
         m_parseState = ParseJpegXLError;
         return false;
     }
 
-    JxlDecoderCloseInput(m_decoder);
+    int events_wanted = JXL_DEC_FULL_IMAGE;
+    m_decode_mode = wantedDecodeMode();
+    if (m_decode_mode == DecodePreview) {
+        events_wanted = JXL_DEC_PREVIEW_IMAGE;
+    } else if (m_decode_mode == DecodeDCOnly) {
+        events_wanted |= JXL_DEC_FRAME_PROGRESSION;
+        JxlDecoderSetProgressiveDetail(m_decoder, kDC);
+    }
 
-    if (m_basicinfo.uses_original_profile == JXL_FALSE && m_basicinfo.have_animation == JXL_FALSE) {
-        if (JxlDecoderSubscribeEvents(m_decoder, JXL_DEC_COLOR_ENCODING | JXL_DEC_FULL_IMAGE) != JXL_DEC_SUCCESS) {
+    if (m_output_profile_set || (m_basicinfo.uses_original_profile == JXL_FALSE && m_basicinfo.have_animation == JXL_FALSE)) {
+        if (JxlDecoderSubscribeEvents(m_decoder, events_wanted | JXL_DEC_COLOR_ENCODING) != JXL_DEC_SUCCESS) {
             qWarning("ERROR: JxlDecoderSubscribeEvents failed");
             m_parseState = ParseJpegXLError;
             return false;
         }
 
-        JxlDecoderStatus status = JxlDecoderProcessInput(m_decoder);
+        JxlDecoderStatus status = processInput();
         if (status != JXL_DEC_COLOR_ENCODING) {
             qWarning("Unexpected event %d instead of JXL_DEC_COLOR_ENCODING", status);
             m_parseState = ParseJpegXLError;
             return false;
         }
 
+        if (m_output_profile_set) {
+            if (!setOutputColorProfile()) {
+                qWarning("ERROR: JXL output color profile cannot be set");
+                m_parseState = ParseJpegXLError;
+                return false;
+            }
+            return true;
+        }
+
         bool is_gray = m_basicinfo.num_color_channels == 1 && m_basicinfo.alpha_bits == 0;
 #if JPEGXL_NUMERIC_VERSION > JPEGXL_COMPUTE_NUMERIC_VERSION(0, 9, 0)
         if (!is_gray) {
@@ -1791,7 +2547,7 @@ bool QJpegXLHandler::rewind()
         JxlColorEncodingSetToSRGB(&color_encoding, is_gray ? JXL_TRUE : JXL_FALSE);
         JxlDecoderSetPreferredColorProfile(m_decoder, &color_encoding);
     } else {
-        if (JxlDecoderSubscribeEvents(m_decoder, JXL_DEC_FULL_IMAGE) != JXL_DEC_SUCCESS) {
+        if (JxlDecoderSubscribeEvents(m_decoder, events_wanted) != JXL_DEC_SUCCESS) {
             qWarning("ERROR: JxlDecoderSubscribeEvents failed");
             m_parseState = ParseJpegXLError;
             return false;
@@ -1800,3 +2556,635 @@ bool QJpegXLHandler::rewind()
 
     return true;
 }
+
+bool QJpegXLHandler::seekDecoder(int imageNumber)
+{
+    /* The decoder can be restarted only from the beginning of the codestream.
+     * It keeps the frame references seen by countALLFrames() across JxlDecoderRewind(),
+     * so the skipped frames before the nearest independent frame are not decoded. */
+    if (imageNumber < m_decoder_frame_index) {
+        if (!rewind()) {
+            return false;
+        }
+    }
+
+    if (imageNumber > m_decoder_frame_index) {
+        JxlDecoderSkipFrames(m_decoder, imageNumber - m_decoder_frame_index);
+        m_decoder_frame_index = imageNumber;
+    }
+
+    return true;
+}
+
+bool QJpegXLHandler::composeFrame(int imageNumber)
+{
+    const FrameIndexEntry &target = m_frame_index.at(imageNumber);
+
+    if (m_decoder_frame_index > imageNumber) {
+        if (!rewind()) {
+            return false;
+        }
+    }
+
+    // frames before restart_frame are skipped, nothing they produced is used any more
+    if (m_decoder_frame_index < target.restart_frame) {
+        JxlDecoderSkipFrames(m_decoder, m_frame_index.at(target.restart_frame).first_layer - m_frame_index.at(m_decoder_frame_index).first_layer);
+        m_decoder_frame_index = target.restart_frame;
+        for (QImage &slot : m_reference_slots) {
+            slot = QImage();
+        }
+    }
+
+    // release the previous frame, so the canvas can be updated in place
+    m_current_image = QImage();
+
+    const uint32_t base_slot = m_layers.at(target.first_layer).blend_source;
+    bool incremental = false;
+
+    QImage canvas;
+    for (; m_decoder_frame_index <= imageNumber; m_decoder_frame_index++) {
+        const FrameIndexEntry &frame = m_frame_index.at(m_decoder_frame_index);
+        if (m_decoder_frame_index == imageNumber) {
+            // only the layers of this frame differ from the previously returned canvas
+            incremental = !m_reference_slots[base_slot].isNull() && m_reference_slots[base_slot].cacheKey() == m_canvas_key;
+        }
+
+        for (int layer = frame.first_layer; layer < frame.first_layer + frame.layer_count; layer++) {
+            if (!composeLayer(layer, &canvas)) {
+                return false;
+            }
+        }
+    }
+
+    m_dirty_rect = fullRect();
+    if (incremental) {
+        QRect changed;
+        for (int layer = target.first_layer; layer < target.first_layer + target.layer_count; layer++) {
+            changed |= m_layers.at(layer).rect;
+        }
+        m_dirty_rect &= changed;
+    }
+
+    m_canvas_key = canvas.cacheKey();
+    m_current_image = canvas;
+    return true;
+}
+
+bool QJpegXLHandler::composeLayer(int layerNumber, QImage *result)
+{
+    const LayerIndexEntry &layer = m_layers.at(layerNumber);
+    *result = QImage();
+
+    JxlDecoderStatus status = processInput();
+    if (status != JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+        qWarning("Unexpected event %d instead of JXL_DEC_NEED_IMAGE_OUT_BUFFER", status);
+        m_parseState = ParseJpegXLError;
+        return false;
+    }
+
+    const JxlPixelConversion conversion = pixelConversion(m_input_image_format, m_target_image_format);
+    QImage layer_image = imageAlloc(layer.rect.width(), layer.rect.height(), conversion == PixelsConvertedAfterwards ? m_input_image_format : m_target_image_format);
+    if (layer_image.isNull()) {
+        qWarning("Memory cannot be allocated");
+        m_parseState = ParseJpegXLError;
+        return false;
+    }
+
+    JxlRegionSink sink;
+    if (swizzledWhileDecoding(conversion)) {
+        sink.bits = layer_image.bits();
+        sink.bytes_per_line = layer_image.bytesPerLine();
+        sink.bytes_per_pixel = bytesPerPixel(m_input_pixel_format);
+        sink.conversion = conversion;
+        sink.left = 0;
+        sink.top = 0;
+        sink.width = layer.rect.width();
+        sink.height = layer.rect.height();
+
+        if (JxlDecoderSetImageOutCallback(m_decoder, &m_input_pixel_format, regionCallback, &sink) != JXL_DEC_SUCCESS) {
+            qWarning("ERROR: JxlDecoderSetImageOutCallback failed");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+    } else {
+        m_input_pixel_format.align = layer_image.bytesPerLine();
+
+        size_t layer_buffer_size = 0;
+        if (JxlDecoderImageOutBufferSize(m_decoder, &m_input_pixel_format, &layer_buffer_size) != JXL_DEC_SUCCESS
+            || layer_buffer_size > size_t(layer_image.sizeInBytes())) {
+            qWarning("ERROR: unexpected size of JXL layer buffer");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+
+        if (JxlDecoderSetImageOutBuffer(m_decoder, &m_input_pixel_format, layer_image.bits(), layer_buffer_size) != JXL_DEC_SUCCESS) {
+            qWarning("ERROR: JxlDecoderSetImageOutBuffer failed");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+    }
+
+    status = processInput();
+    if (status != JXL_DEC_FULL_IMAGE) {
+        qWarning("Unexpected event %d instead of JXL_DEC_FULL_IMAGE", status);
+        m_parseState = ParseJpegXLError;
+        return false;
+    }
+
+    if (layer_image.format() != m_target_image_format) {
+        layer_image.convertTo(m_target_image_format);
+    }
+
+    QImage canvas = m_reference_slots[layer.blend_source];
+    if (layer.saved_as == int(layer.blend_source)) {
+        // the slot gets the result, its old content does not need a copy
+        m_reference_slots[layer.blend_source] = QImage();
+    }
+
+    if (canvas.isNull()) {
+        canvas = imageAlloc(m_basicinfo.xsize, m_basicinfo.ysize, m_target_image_format);
+        if (canvas.isNull()) {
+            qWarning("Memory cannot be allocated");
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+        canvas.fill(0);
+        canvas.setColorSpace(m_colorspace);
+    }
+
+    blendLayer(&canvas, layer_image, layer.rect.topLeft(), layer.blend_mode);
+
+    if (layer.saved_as >= 0) {
+        m_reference_slots[layer.saved_as] = canvas;
+    }
+
+    *result = canvas;
+    return true;
+}
+
+QRect QJpegXLHandler::fullRect() const
+{
+    return QRect(0, 0, m_basicinfo.xsize, m_basicinfo.ysize);
+}
+
+QRect QJpegXLHandler::decodedRect() const
+{
+    if (m_clip_rect.isValid()) {
+        return m_clip_rect.intersected(fullRect());
+    }
+    return fullRect();
+}
+
+QJpegXLHandler::FrameDecodeMode QJpegXLHandler::wantedDecodeMode() const
+{
+    if (m_basicinfo.have_animation || m_isCMYK) {
+        return DecodeFullFrame;
+    }
+
+    const bool scaling = m_scaled_size.isValid() && !m_scaled_size.isEmpty();
+
+    if (m_basicinfo.have_preview && !m_clip_rect.isValid()) {
+        if (m_prefer_preview) {
+            return DecodePreview;
+        }
+
+        if (scaling && m_scaled_size.width() <= int(m_basicinfo.preview.xsize) && m_scaled_size.height() <= int(m_basicinfo.preview.ysize)) {
+            return DecodePreview;
+        }
+    }
+
+    if (scaling) {
+        const QRect region = decodedRect();
+        if ((qint64(m_scaled_size.width()) * kDCDownsamplingRatio <= region.width())
+            && (qint64(m_scaled_size.height()) * kDCDownsamplingRatio <= region.height())) {
+            return DecodeDCOnly;
+        }
+    }
+
+    return DecodeFullFrame;
+}
+
+/* Whether the format returned for ImageFormat depends on more than the basic info:
+ * CMYK needs the color profile and the extra channels, tone mapping needs the color encoding.
+ * Before the frames are counted, the file is parsed up to them in such cases. */
+bool QJpegXLHandler::formatNeedsColorInfo() const
+{
+    if (m_parseState == ParseJpegXLSuccess || m_parseState == ParseJpegXLFinished) {
+        return false;
+    }
+
+    if (m_tone_map_nits > 0) {
+        return true;
+    }
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+    const uint32_t alpha_channels = (m_basicinfo.alpha_bits > 0) ? 1 : 0;
+    if (m_basicinfo.uses_original_profile == JXL_TRUE && m_basicinfo.num_color_channels == 3 && m_basicinfo.num_extra_channels > alpha_channels) {
+        return true; // there may be a BLACK channel
+    }
+#endif
+    return false;
+}
+
+bool QJpegXLHandler::hasBlackChannel() const
+{
+    JxlExtraChannelInfo channel_info;
+    for (uint32_t index = 0; index < m_basicinfo.num_extra_channels; index++) {
+        if (JxlDecoderGetExtraChannelInfo(m_decoder, index, &channel_info) == JXL_DEC_SUCCESS && channel_info.type == JXL_CHANNEL_BLACK) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool QJpegXLHandler::isHighDynamicRange() const
+{
+    if (m_basicinfo.exponent_bits_per_sample > 0 || m_basicinfo.intensity_target > kSdrIntensityTarget) {
+        return true;
+    }
+
+    JxlColorEncoding original_encoding;
+    if (JxlDecoderGetColorAsEncodedProfile(m_decoder,
+#if JPEGXL_NUMERIC_VERSION < JPEGXL_COMPUTE_NUMERIC_VERSION(0, 9, 0)
+                                           &m_input_pixel_format,
+#endif
+                                           JXL_COLOR_PROFILE_TARGET_ORIGINAL,
+                                           &original_encoding)
+        == JXL_DEC_SUCCESS) {
+        return original_encoding.transfer_function == JXL_TRANSFER_FUNCTION_PQ || original_encoding.transfer_function == JXL_TRANSFER_FUNCTION_HLG;
+    }
+    return false;
+}
+
+/* Makes libjxl convert the decoded pixels into the colorspace requested by QT_JPEGXL_COLORSPACE,
+ * inside its multithreaded pipeline. Called after JXL_DEC_COLOR_ENCODING.
+ * Tone mapped images go to sRGB unless another colorspace was requested.
+ * Without a CMS (libjxl < 0.9), only XYB encoded images can be converted. */
+bool QJpegXLHandler::setOutputColorProfile()
+{
+    const JXL_BOOL is_gray = (m_basicinfo.num_color_channels == 1) ? JXL_TRUE : JXL_FALSE;
+
+    if (m_tone_mapped && JxlDecoderSetDesiredIntensityTarget(m_decoder, m_tone_map_nits) != JXL_DEC_SUCCESS) {
+        return false;
+    }
+
+    JxlColorEncoding color_encoding;
+    if (m_output_colorspace == OutputSRgbLinear) {
+        JxlColorEncodingSetToLinearSRGB(&color_encoding, is_gray);
+    } else {
+        JxlColorEncodingSetToSRGB(&color_encoding, is_gray);
+        if (m_output_colorspace == OutputDisplayP3 && !is_gray) {
+            color_encoding.primaries = JXL_PRIMARIES_P3;
+        }
+    }
+
+#if JPEGXL_NUMERIC_VERSION > JPEGXL_COMPUTE_NUMERIC_VERSION(0, 9, 0)
+    const JxlCmsInterface *jxlcms = JxlGetDefaultCms();
+    if (jxlcms && JxlDecoderSetCms(m_decoder, *jxlcms) == JXL_DEC_SUCCESS) {
+        return JxlDecoderSetOutputColorProfile(m_decoder, &color_encoding, nullptr, 0) == JXL_DEC_SUCCESS;
+    }
+#endif
+
+    if (m_basicinfo.uses_original_profile == JXL_FALSE) {
+        return JxlDecoderSetPreferredColorProfile(m_decoder, &color_encoding) == JXL_DEC_SUCCESS;
+    }
+    return false;
+}
+
+/* High bit depth images may be decoded with 8-bit precision by admitDecoding()
+ * when the memory limit or QImageReader::allocationLimit() is exceeded. */
+bool QJpegXLHandler::formatMayFallBackToEightBits() const
+{
+    if (m_basicinfo.bits_per_sample <= 8) {
+        return false;
+    }
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    if (QImageReader::allocationLimit() > 0) {
+        return true;
+    }
+#endif
+    return m_memory_budget > 0;
+}
+
+/* Pixel formats of libjxl output and of the returned QImage, from the basic info.
+ * CMYK images detected later in countALLFrames() are converted separately. */
+void QJpegXLHandler::selectFormats()
+{
+    const bool is_gray = m_basicinfo.num_color_channels == 1 && m_basicinfo.alpha_bits == 0;
+    const bool loadalpha = m_basicinfo.alpha_bits > 0;
+
+    m_input_pixel_format.endianness = JXL_NATIVE_ENDIAN;
+    m_input_pixel_format.align = 4;
+
+    if (m_basicinfo.bits_per_sample > 8) { // high bit depth
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+        bool is_fp = m_basicinfo.exponent_bits_per_sample > 0 && m_basicinfo.num_color_channels == 3;
+#endif
+
+        m_input_pixel_format.num_channels = 4;
+
+        if (is_gray) {
+            m_input_pixel_format.num_channels = 1;
+            m_input_pixel_format.data_type = JXL_TYPE_UINT16;
+            m_input_image_format = m_target_image_format = QImage::Format_Grayscale16;
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+        } else if (m_basicinfo.bits_per_sample > 16 && is_fp) {
+            m_input_pixel_format.data_type = JXL_TYPE_FLOAT;
+            m_input_image_format = QImage::Format_RGBA32FPx4;
+            if (loadalpha)
+                m_target_image_format = QImage::Format_RGBA32FPx4;
+            else
+                m_target_image_format = QImage::Format_RGBX32FPx4;
+#endif
+        } else {
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+            m_input_pixel_format.data_type = is_fp ? JXL_TYPE_FLOAT16 : JXL_TYPE_UINT16;
+            m_input_image_format = is_fp ? QImage::Format_RGBA16FPx4 : QImage::Format_RGBA64;
+            if (loadalpha)
+                m_target_image_format = is_fp ? QImage::Format_RGBA16FPx4 : QImage::Format_RGBA64;
+            else
+                m_target_image_format = is_fp ? QImage::Format_RGBX16FPx4 : QImage::Format_RGBX64;
+#else
+            m_input_pixel_format.data_type = JXL_TYPE_UINT16;
+            m_input_image_format = QImage::Format_RGBA64;
+            if (loadalpha)
+                m_target_image_format = QImage::Format_RGBA64;
+            else
+                m_target_image_format = QImage::Format_RGBX64;
+#endif
+        }
+    } else { // 8bit depth
+        selectEightBitFormats();
+    }
+}
+
+void QJpegXLHandler::selectEightBitFormats()
+{
+    m_input_pixel_format.data_type = JXL_TYPE_UINT8;
+
+    if (m_basicinfo.num_color_channels == 1 && m_basicinfo.alpha_bits == 0) {
+        m_input_pixel_format.num_channels = 1;
+        m_input_image_format = m_target_image_format = QImage::Format_Grayscale8;
+    } else {
+        if (m_basicinfo.alpha_bits > 0) {
+            m_input_pixel_format.num_channels = 4;
+            m_input_image_format = QImage::Format_RGBA8888;
+            m_target_image_format = QImage::Format_ARGB32;
+        } else {
+            m_input_pixel_format.num_channels = 3;
+            m_input_image_format = QImage::Format_RGB888;
+            m_target_image_format = QImage::Format_RGB32;
+        }
+    }
+}
+
+QJpegXLHandler::MemoryEstimate QJpegXLHandler::estimateMemory() const
+{
+    MemoryEstimate estimate;
+    const FrameDecodeMode mode = wantedDecodeMode();
+    const QRect region = decodedRect();
+    const bool converted_afterwards = pixelConversion(m_input_image_format, m_target_image_format) == PixelsConvertedAfterwards;
+
+    QSize decoded_size = region.size();
+    qint64 decoded_pixels = qint64(m_basicinfo.xsize) * qint64(m_basicinfo.ysize);
+    if (mode == DecodePreview) {
+        decoded_size = QSize(m_basicinfo.preview.xsize, m_basicinfo.preview.ysize);
+        decoded_pixels = qint64(decoded_size.width()) * decoded_size.height();
+    } else if (mode == DecodeDCOnly) {
+        // decoded_pixels stays, libjxl decodes the whole frame when the DC pass cannot be flushed
+        decoded_size = QSize((region.width() + kDCDownsamplingRatio - 1) / kDCDownsamplingRatio,
+                             (region.height() + kDCDownsamplingRatio - 1) / kDCDownsamplingRatio);
+    }
+
+    const qint64 frame_bytes = imageBytes(decoded_size, m_target_image_format);
+    estimate.images = frame_bytes;
+    estimate.largest = frame_bytes;
+
+    if (m_isCMYK) {
+        // BLACK plane of the whole frame next to the CMY samples
+        estimate.largest = imageBytes(decoded_size, QImage::Format_ARGB32);
+        estimate.images = estimate.largest + qint64(m_basicinfo.xsize) * qint64(m_basicinfo.ysize);
+    } else if (mode == DecodePreview || converted_afterwards) {
+        const qint64 input_bytes = imageBytes(decoded_size, m_input_image_format);
+        estimate.images += input_bytes;
+        estimate.largest = qMax(estimate.largest, input_bytes);
+    }
+
+    if (mode == DecodeDCOnly) {
+        // sums of the 8x8 blocks
+        estimate.images += qint64(decoded_size.width()) * decoded_size.height() * m_input_pixel_format.num_channels * qint64(sizeof(float));
+    }
+
+    if (m_layer_mode) {
+        // canvas, the layer being blended and the reference slots in use
+        bool slot_used[4] = {false, false, false, false};
+        for (const LayerIndexEntry &layer : m_layers) {
+            if (layer.saved_as >= 0) {
+                slot_used[layer.saved_as] = true;
+            }
+        }
+
+        const qint64 canvas_bytes = imageBytes(fullRect().size(), m_target_image_format);
+        estimate.images = 2 * canvas_bytes;
+        estimate.largest = canvas_bytes;
+        for (bool used : slot_used) {
+            if (used) {
+                estimate.images += canvas_bytes;
+            }
+        }
+        if (converted_afterwards) {
+            const qint64 input_bytes = imageBytes(fullRect().size(), m_input_image_format);
+            estimate.images += input_bytes;
+            estimate.largest = qMax(estimate.largest, input_bytes);
+        }
+    }
+
+    if (m_scaled_size.isValid() && !m_scaled_size.isEmpty() && m_scaled_size != decoded_size) {
+        const qint64 scaled_bytes = imageBytes(m_scaled_size, m_target_image_format);
+        estimate.images += scaled_bytes;
+        estimate.largest = qMax(estimate.largest, scaled_bytes);
+    }
+
+    // libjxl keeps a 32-bit sample of every channel for each pixel of the frame
+    estimate.decoder = decoded_pixels * 4 * qint64(m_basicinfo.num_color_channels + m_basicinfo.num_extra_channels);
+
+    estimate.background = 0;
+    if (m_framedelays.count() > 1) {
+        estimate.background = qint64(m_frame_cache.maxCost()) * 1024;
+        if (m_prefetch_depth > 0 && m_input_mode != InputStreamed) {
+            estimate.background += qint64(m_prefetch_depth + 1) * frame_bytes + estimate.images + estimate.decoder;
+        }
+    }
+
+    return estimate;
+}
+
+/* Checks the largest image against QImageReader::allocationLimit(), which limits
+ * every single allocation, and the estimated peak memory against QT_JPEGXL_MEMORY_LIMIT
+ * before a frame is decoded. Over a limit, cheaper modes are used as long as they exist. */
+bool QJpegXLHandler::admitDecoding()
+{
+    qint64 image_limit = 0;
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    image_limit = qint64(QImageReader::allocationLimit()) * 1024 * 1024;
+#endif
+
+    for (;;) {
+        const MemoryEstimate estimate = estimateMemory();
+        const qint64 total = estimate.images + estimate.decoder + estimate.background;
+        const bool over_image_limit = image_limit > 0 && estimate.largest > image_limit;
+        const bool over_budget = m_memory_budget > 0 && total > m_memory_budget;
+        if (!over_image_limit && !over_budget) {
+            return true;
+        }
+
+        // only the 8-bit fallback makes the largest image smaller
+        if (over_budget && estimate.background > 0) {
+            retirePrefetch();
+            m_prefetch_depth = 0;
+            m_frame_cache.setMaxCost(0);
+        } else if (over_budget && m_layer_mode) {
+            if (!restartCoalesced()) {
+                return false;
+            }
+        } else if (m_input_pixel_format.data_type != JXL_TYPE_UINT8 && !m_isCMYK) {
+            qWarning("JXL image (%dx%d) is decoded with 8-bit precision to fit the memory limit", m_basicinfo.xsize, m_basicinfo.ysize);
+            selectEightBitFormats();
+        } else if (over_image_limit) {
+            qWarning("JXL image (%dx%d) needs an image of about %lld MiB, more than QImageReader::allocationLimit()",
+                     m_basicinfo.xsize,
+                     m_basicinfo.ysize,
+                     estimate.largest / (1024 * 1024));
+            m_parseState = ParseJpegXLError;
+            return false;
+        } else {
+            qWarning("JXL image (%dx%d) needs about %lld MiB of memory, more than allowed", m_basicinfo.xsize, m_basicinfo.ysize, total / (1024 * 1024));
+            m_parseState = ParseJpegXLError;
+            return false;
+        }
+    }
+}
+
+bool QJpegXLHandler::isMappingValid() const
+{
+    return m_mapped_data && m_mapped_file && m_mapped_file->isOpen();
+}
+
+/* The mapped input is copied and decoding continues from the copy, as if the file
+ * had been read completely at the start. Called when the file is about to close. */
+void QJpegXLHandler::releaseMapping()
+{
+    QObject::disconnect(m_mapped_file_closing);
+    if (!m_mapped_data) {
+        return;
+    }
+
+    // prefetch threads read the mapped data directly
+    stopPrefetch();
+
+    if (isMappingValid()) {
+        m_rawData = QByteArray(reinterpret_cast<const char *>(m_mapped_data), m_mapped_size);
+        m_input_mode = InputBuffered;
+
+        if (m_decoder) {
+            const size_t remaining = JxlDecoderReleaseInput(m_decoder);
+            const uint8_t *input_data = reinterpret_cast<const uint8_t *>(m_rawData.constData()) + (size_t(m_rawData.size()) - remaining);
+            if (JxlDecoderSetInput(m_decoder, input_data, remaining) != JXL_DEC_SUCCESS) {
+                qWarning("ERROR: JxlDecoderSetInput failed");
+                m_parseState = ParseJpegXLError;
+            }
+            JxlDecoderCloseInput(m_decoder);
+        }
+        m_mapped_file->unmap(m_mapped_data);
+    } else {
+        qWarning("JXL plug-in: the input file was unmapped while decoding");
+        m_parseState = ParseJpegXLError;
+    }
+
+    m_mapped_file = nullptr;
+    m_mapped_data = nullptr;
+    m_mapped_size = 0;
+}
+
+bool QJpegXLHandler::resetInput()
+{
+    if (m_input_mode == InputMapped) {
+        if (!isMappingValid()) {
+            qWarning("JXL plug-in: the input file is no longer mapped");
+            return false;
+        }
+
+        if (JxlDecoderSetInput(m_decoder, m_mapped_data, m_mapped_size) != JXL_DEC_SUCCESS) {
+            qWarning("ERROR: JxlDecoderSetInput failed");
+            return false;
+        }
+
+        JxlDecoderCloseInput(m_decoder);
+        return true;
+    }
+
+    if (m_input_mode == InputBuffered) {
+        if (JxlDecoderSetInput(m_decoder, reinterpret_cast<const uint8_t *>(m_rawData.constData()), m_rawData.size()) != JXL_DEC_SUCCESS) {
+            qWarning("ERROR: JxlDecoderSetInput failed");
+            return false;
+        }
+
+        JxlDecoderCloseInput(m_decoder);
+        return true;
+    }
+
+    if (!device()->seek(m_input_start)) {
+        qWarning("ERROR: JXL plug-in failed to seek in the input device");
+        return false;
+    }
+
+    m_rawData.resize(0);
+    m_input_eof = false;
+    return feedInput();
+}
+
+bool QJpegXLHandler::feedInput()
+{
+    const size_t remaining = JxlDecoderReleaseInput(m_decoder);
+    if (m_input_eof) {
+        return false;
+    }
+
+    // keep bytes not consumed by the decoder at the beginning of the buffer
+    if (remaining > 0 && remaining < size_t(m_rawData.size())) {
+        memmove(m_rawData.data(), m_rawData.constData() + (m_rawData.size() - remaining), remaining);
+    }
+
+    m_rawData.resize(remaining + kInputChunkSize);
+    const qint64 read_bytes = device()->read(m_rawData.data() + remaining, kInputChunkSize);
+    if (read_bytes < 0) {
+        qWarning("Read error: %s", qUtf8Printable(device()->errorString()));
+        m_rawData.resize(remaining);
+        m_input_eof = true;
+        return false;
+    }
+
+    m_rawData.resize(remaining + read_bytes);
+    m_input_eof = (read_bytes == 0) || device()->atEnd();
+
+    if (JxlDecoderSetInput(m_decoder, reinterpret_cast<const uint8_t *>(m_rawData.constData()), m_rawData.size()) != JXL_DEC_SUCCESS) {
+        qWarning("ERROR: JxlDecoderSetInput failed");
+        return false;
+    }
+
+    if (m_input_eof) {
+        JxlDecoderCloseInput(m_decoder);
+    }
+
+    return read_bytes > 0;
+}
+
+JxlDecoderStatus QJpegXLHandler::processInput()
+{
+    JxlDecoderStatus status = JxlDecoderProcessInput(m_decoder);
+    while (status == JXL_DEC_NEED_MORE_INPUT && m_input_mode == InputStreamed && feedInput()) {
+        status = JxlDecoderProcessInput(m_decoder);
+    }
+    return status;
+}
@@ -2,14 +2,23 @@
 #define QJPEGXLHANDLER_P_H
 
 #include <QByteArray>
+#include <QCache>
 #include <QColorSpace>
+#include <QFileDevice>
 #include <QImage>
 #include <QImageIOHandler>
+#include <QPointer>
+#include <QRect>
 #include <QVariant>
 #include <QVector>
 
 #include <jxl/decode.h>
 
+#include "qjpegxlmemory_p.h"
+#include "qjpegxlrunner_p.h"
+
+class QJpegXLPrefetcher;
+
 class QJpegXLHandler : public QImageIOHandler
 {
 public:
@@ -32,16 +41,46 @@ public:
     bool jumpToImage(int imageNumber) override;
 
     int nextImageDelay() const override;
+    QRect currentImageRect() const override;
 
     int loopCount() const override;
 
 private:
     bool ensureParsed() const;
+    bool ensureBasicInfo() const;
+    bool probeBasicInfo();
     bool ensureALLCounted() const;
     bool ensureDecoder();
     bool countALLFrames();
     bool decode_one_frame();
+    bool complete_frame();
+    bool finish_frame();
+    void cacheCurrentFrame();
+    void startPrefetch();
+    void retirePrefetch();
+    void stopPrefetch();
     bool rewind();
+    bool seekDecoder(int imageNumber);
+    bool startDecoding();
+    bool restartCoalesced();
+    bool composeFrame(int imageNumber);
+    bool composeLayer(int layerNumber, QImage *result);
+    QRect fullRect() const;
+    QRect decodedRect() const;
+    bool formatNeedsColorInfo() const;
+    bool formatMayFallBackToEightBits() const;
+    bool hasBlackChannel() const;
+    bool isHighDynamicRange() const;
+    bool setOutputColorProfile();
+    void selectFormats();
+    void selectEightBitFormats();
+    bool admitDecoding();
+
+    bool isMappingValid() const;
+    void releaseMapping();
+    bool resetInput();
+    bool feedInput();
+    JxlDecoderStatus processInput();
 
     enum ParseJpegXLState {
         ParseJpegXLError = -1,
@@ -51,30 +90,114 @@ private:
         ParseJpegXLFinished = 3,
     };
 
+    enum FrameDecodeMode {
+        DecodeFullFrame = 0,
+        DecodeDCOnly = 1, // 1:8 DC pass of the frame
+        DecodePreview = 2, // embedded preview image
+    };
+
+    enum InputMode {
+        InputBuffered = 0, // whole stream in m_rawData
+        InputStreamed = 1, // m_rawData holds a window of a seekable device
+        InputMapped = 2, // memory-mapped view of a file
+    };
+
+    enum OutputColorSpace {
+        OutputOriginal = 0, // colorspace of the file
+        OutputSRgb = 1,
+        OutputSRgbLinear = 2,
+        OutputDisplayP3 = 3,
+    };
+
+    FrameDecodeMode wantedDecodeMode() const;
+
+    /* Peak memory of decoding one frame in the current mode, in bytes. */
+    struct MemoryEstimate {
+        qint64 images; // QImages and buffers allocated by the plug-in at the same time
+        qint64 largest; // biggest single QImage of them
+        qint64 decoder; // approximate working set of libjxl
+        qint64 background; // frame cache and prefetched frames
+    };
+
+    MemoryEstimate estimateMemory() const;
+
+    /* Header of one layer (one JXL_DEC_FRAME event), collected by countALLFrames()
+     * in layer mode only. With coalescing, libjxl composites the layers and keeps
+     * the frame references itself, so no index is built. */
+    struct LayerIndexEntry {
+        QRect rect; // position of the layer on the canvas
+        JxlBlendMode blend_mode;
+        uint32_t blend_source; // reference slot blended with
+        bool blend_main_alpha; // alpha of the blending is the main alpha channel (extra channel 0), without clamping
+        int saved_as; // reference slot which keeps the result, -1 when not saved
+    };
+
+    /* Displayed frame of an animation and the layers composited into it.
+     * Decoding from restart_frame with empty reference slots reproduces the exact
+     * state after this frame, as nothing written before restart_frame is used. */
+    struct FrameIndexEntry {
+        int first_layer;
+        int layer_count;
+        int restart_frame;
+    };
+
     ParseJpegXLState m_parseState;
     int m_quality;
     int m_currentimage_index;
     int m_previousimage_index;
+    int m_decoder_frame_index; // frame which the decoder returns next
 
     QByteArray m_rawData;
+    InputMode m_input_mode;
+    qint64 m_input_start;
+    bool m_input_eof;
+
+    QPointer<QFileDevice> m_mapped_file;
+    QMetaObject::Connection m_mapped_file_closing; // releaseMapping() before the file unmaps its data
+    uchar *m_mapped_data;
+    qsizetype m_mapped_size;
 
     JxlDecoder *m_decoder;
-    void *m_runner;
+    QJpegXLRunner m_runner;
     JxlBasicInfo m_basicinfo;
+    bool m_basicinfo_probed; // m_basicinfo read by probeBasicInfo(), the decoder is not set up yet
 
     QVector<int> m_framedelays;
+    QVector<FrameIndexEntry> m_frame_index;
+    QVector<LayerIndexEntry> m_layers;
+
+    bool m_layer_mode; // coalescing disabled, layers are composited by the plug-in
+    QImage m_reference_slots[4];
+    qint64 m_canvas_key; // cacheKey() of the last composited canvas
+    QRect m_dirty_rect;
     int m_next_image_delay;
 
     QImage m_current_image;
+    QCache<int, QImage> m_frame_cache; // decoded animation frames, cost in KiB
+    QJpegXLPrefetcher *m_prefetcher;
+    QVector<QJpegXLPrefetcher *> m_retired_prefetchers; // stopped, still finishing their last frame
+    int m_prefetch_depth;
+    qint64 m_memory_budget; // bytes for the whole decoding, 0 when unlimited
+    QJpegXLMemoryManager m_memory; // m_memory_budget is the hard limit of its allocations
     QColorSpace m_colorspace;
     bool m_isCMYK;
     uint32_t m_cmyk_channel_id;
-    uint32_t m_alpha_channel_id;
 
     QImage::Format m_input_image_format;
     QImage::Format m_target_image_format;
 
     JxlPixelFormat m_input_pixel_format;
+
+    QSize m_scaled_size;
+    QRect m_clip_rect;
+    bool m_prefer_preview;
+    FrameDecodeMode m_decode_mode;
+    OutputColorSpace m_output_colorspace; // QT_JPEGXL_COLORSPACE
+    bool m_output_profile_set; // libjxl converts to m_output_colorspace
+    int m_tone_map_nits; // QT_JPEGXL_TONEMAP, SDR peak luminance for HDR images, 0 when disabled
+    bool m_tone_mapped; // HDR image tone mapped by libjxl into 8-bit output
+
+    friend class QJpegXLPrefetcher;
 };
 
 #endif // QJPEGXLHANDLER_P_H
@@ -0,0 +1,155 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#include <QSize>
+
+#include "qjpegxldecoderpool_p.h"
+#include "qjpegxlencoderoutput_p.h"
+#include "qjpegxljpeg.h"
+#include "qjpegxlmemory_p.h"
+#include "qjpegxlrunner_p.h"
+
+#include <jxl/encode.h>
+
+namespace
+{
+/* Dimensions from the SOF segment of a JPEG bitstream, empty when not found. */
+QSize jpegFrameSize(const QByteArray &jpeg_data)
+{
+    const uchar *data = reinterpret_cast<const uchar *>(jpeg_data.constData());
+    const int size = jpeg_data.size();
+
+    int pos = 2; // after SOI
+    while (pos + 4 <= size && data[pos] == 0xFF) {
+        const uchar marker = data[pos + 1];
+        const int length = (data[pos + 2] << 8) | data[pos + 3];
+        const bool is_sof = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+        if (is_sof && pos + 9 <= size) {
+            return QSize((data[pos + 7] << 8) | data[pos + 8], (data[pos + 5] << 8) | data[pos + 6]);
+        }
+        if (marker == 0xDA) { // start of scan without a frame header
+            break;
+        }
+        pos += 2 + length;
+    }
+    return QSize();
+}
+}
+
+/* Original JPEG bitstream of a file made by lossless JPEG recompression,
+ * rebuilt from the jbrd box and the DCT coefficients without decoding pixels.
+ * Returns false when the file does not carry JPEG reconstruction data. */
+bool QJpegXLJpeg::reconstructJpeg(QIODevice *device, QByteArray *jpeg_data)
+{
+    if (!device || !jpeg_data) {
+        return false;
+    }
+
+    jpeg_data->clear();
+    const QByteArray data = device->readAll();
+    if (data.isEmpty()) {
+        return false;
+    }
+
+    QJpegXLMemoryManager memory;
+    JxlDecoder *decoder = QJpegXLDecoderPool::checkOut(&memory);
+    if (!decoder) {
+        qWarning("ERROR: JxlDecoderCreate failed");
+        return false;
+    }
+
+    bool reconstructed = false;
+    size_t used_size = 0;
+    if (JxlDecoderSubscribeEvents(decoder, JXL_DEC_JPEG_RECONSTRUCTION | JXL_DEC_FULL_IMAGE) == JXL_DEC_SUCCESS
+        && JxlDecoderSetInput(decoder, reinterpret_cast<const uint8_t *>(data.constData()), data.size()) == JXL_DEC_SUCCESS) {
+        JxlDecoderCloseInput(decoder);
+
+        for (bool finished = false; !finished;) {
+            switch (JxlDecoderProcessInput(decoder)) {
+            case JXL_DEC_JPEG_RECONSTRUCTION:
+                // the JPEG is usually about 20% bigger than the recompressed file
+                jpeg_data->resize(data.size() + data.size() / 4 + 4096);
+                finished = JxlDecoderSetJPEGBuffer(decoder, reinterpret_cast<uint8_t *>(jpeg_data->data()), jpeg_data->size()) != JXL_DEC_SUCCESS;
+                break;
+            case JXL_DEC_JPEG_NEED_MORE_OUTPUT:
+                used_size = jpeg_data->size() - JxlDecoderReleaseJPEGBuffer(decoder);
+                jpeg_data->resize(jpeg_data->size() * 2);
+                finished = JxlDecoderSetJPEGBuffer(decoder, reinterpret_cast<uint8_t *>(jpeg_data->data()) + used_size, jpeg_data->size() - used_size)
+                    != JXL_DEC_SUCCESS;
+                break;
+            case JXL_DEC_FULL_IMAGE:
+                if (!jpeg_data->isEmpty()) {
+                    used_size = jpeg_data->size() - JxlDecoderReleaseJPEGBuffer(decoder);
+                    jpeg_data->resize(int(used_size));
+                    reconstructed = true;
+                }
+                finished = true;
+                break;
+            default:
+                // JXL_DEC_NEED_IMAGE_OUT_BUFFER comes when there is no reconstruction data
+                finished = true;
+                break;
+            }
+        }
+    }
+
+    QJpegXLDecoderPool::checkIn(decoder);
+
+    if (!reconstructed) {
+        jpeg_data->clear();
+    }
+    return reconstructed;
+}
+
+/* Lossless recompression of a JPEG bitstream, reversible by reconstructJpeg().
+ * The DCT coefficients are taken over and the jbrd box keeps everything else,
+ * so no pixels are decoded or encoded. */
+bool QJpegXLJpeg::transcodeJpeg(const QByteArray &jpeg_data, QIODevice *device)
+{
+    if (!device || jpeg_data.isEmpty()) {
+        return false;
+    }
+
+    QJpegXLMemoryManager memory;
+    JxlEncoder *encoder = JxlEncoderCreate(memory.jxlMemoryManager());
+    if (!encoder) {
+        qWarning("Failed to create Jxl encoder");
+        return false;
+    }
+
+    const QSize jpeg_size = jpegFrameSize(jpeg_data);
+    QJpegXLRunner runner;
+    runner.setWorkerThreads(QJpegXLRunner::workerThreadsFor(jpeg_size.width(), jpeg_size.height()));
+
+    if (runner.isParallel()) {
+        if (JxlEncoderSetParallelRunner(encoder, QJpegXLRunner::run, &runner) != JXL_ENC_SUCCESS) {
+            qWarning("JxlEncoderSetParallelRunner failed");
+            JxlEncoderDestroy(encoder);
+            return false;
+        }
+    }
+
+    // the jbrd box needs the container format
+    JxlEncoderUseContainer(encoder, JXL_TRUE);
+
+    if (JxlEncoderStoreJPEGMetadata(encoder, JXL_TRUE) != JXL_ENC_SUCCESS) {
+        qWarning("JxlEncoderStoreJPEGMetadata failed!");
+        JxlEncoderDestroy(encoder);
+        return false;
+    }
+
+    JxlEncoderFrameSettings *frame_settings = JxlEncoderFrameSettingsCreate(encoder, nullptr);
+    if (JxlEncoderAddJPEGFrame(frame_settings, reinterpret_cast<const uint8_t *>(jpeg_data.constData()), jpeg_data.size()) != JXL_ENC_SUCCESS) {
+        qWarning("JxlEncoderAddJPEGFrame failed, the data is not a supported JPEG");
+        JxlEncoderDestroy(encoder);
+        return false;
+    }
+
+    JxlEncoderCloseInput(encoder);
+
+    const bool written = QJpegXLEncoderOutput::write(encoder, device);
+    JxlEncoderDestroy(encoder);
+    return written;
+}
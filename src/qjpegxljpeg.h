@@ -0,0 +1,33 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#ifndef QJPEGXLJPEG_H
+#define QJPEGXLJPEG_H
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QtGlobal>
+
+#if defined(QJPEGXLJPEG_LIBRARY)
+#define QJPEGXLJPEG_EXPORT Q_DECL_EXPORT
+#else
+#define QJPEGXLJPEG_EXPORT Q_DECL_IMPORT
+#endif
+
+/* Lossless conversion between JPEG and JPEG XL, without decoding pixels.
+ * The image plug-in always returns decoded pixels, so these conversions
+ * are offered by the QJpegXLJpeg library which applications link to. */
+class QJPEGXLJPEG_EXPORT QJpegXLJpeg
+{
+public:
+    // original JPEG bitstream of a file made by transcodeJpeg() or by cjxl from a JPEG,
+    // false when the file does not carry JPEG reconstruction data
+    static bool reconstructJpeg(QIODevice *device, QByteArray *jpeg_data);
+
+    // recompression of a JPEG bitstream, reversible by reconstructJpeg()
+    static bool transcodeJpeg(const QByteArray &jpeg_data, QIODevice *device);
+};
+
+#endif // QJPEGXLJPEG_H
@@ -0,0 +1,214 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#include "qjpegxlmemory_p.h"
+
+#include <cstddef>
+#include <limits>
+#include <stdlib.h>
+
+// blocks kept by the arena of one thread
+static constexpr int kArenaBlocks = 32;
+static constexpr size_t kArenaBytes = 16 * 1024 * 1024;
+
+// bytes kept by the arenas of all threads together
+static constexpr qint64 kCachedBytesLimit = 64 * 1024 * 1024;
+
+// smaller blocks are rounded up to a power of two, larger ones to 1/8 of it
+static constexpr size_t kMinBlockSize = 64;
+static constexpr size_t kPowerOfTwoLimit = 64 * 1024;
+
+namespace
+{
+QAtomicInteger<qint64> s_cached_bytes;
+
+struct alignas(std::max_align_t) BlockHeader {
+    size_t capacity; // usable bytes after the header
+    size_t size; // bytes requested by the caller
+};
+
+size_t blockCapacity(size_t size)
+{
+    size_t power = kMinBlockSize;
+    while (power < size && power < kPowerOfTwoLimit) {
+        power *= 2;
+    }
+    if (power >= size) {
+        return power;
+    }
+
+    while (power <= size / 2) {
+        power *= 2;
+    }
+    const size_t step = power / 8;
+    return (size + step - 1) / step * step;
+}
+
+class JxlArena
+{
+public:
+    JxlArena()
+        : m_count(0)
+        , m_bytes(0)
+    {
+    }
+
+    ~JxlArena();
+
+    BlockHeader *take(size_t capacity)
+    {
+        for (int i = m_count - 1; i >= 0; i--) {
+            if (m_blocks[i]->capacity == capacity) {
+                BlockHeader *block = m_blocks[i];
+                m_blocks[i] = m_blocks[--m_count];
+                m_bytes -= capacity;
+                s_cached_bytes.fetchAndAddRelaxed(-qint64(capacity));
+                return block;
+            }
+        }
+        return nullptr;
+    }
+
+    void give(BlockHeader *block)
+    {
+        const qint64 capacity = qint64(block->capacity);
+        if (m_count == kArenaBlocks || m_bytes + block->capacity > kArenaBytes) {
+            free(block);
+            return;
+        }
+
+        // with many threads (QThreadPool workers), the process-wide limit applies first
+        if (s_cached_bytes.fetchAndAddRelaxed(capacity) + capacity > kCachedBytesLimit) {
+            s_cached_bytes.fetchAndAddRelaxed(-capacity);
+            free(block);
+            return;
+        }
+
+        m_blocks[m_count++] = block;
+        m_bytes += block->capacity;
+    }
+
+private:
+    BlockHeader *m_blocks[kArenaBlocks];
+    int m_count;
+    size_t m_bytes;
+};
+
+// blocks may be freed while the thread exits, after its arena is gone
+thread_local bool t_arena_destroyed = false;
+
+JxlArena::~JxlArena()
+{
+    for (int i = 0; i < m_count; i++) {
+        free(m_blocks[i]);
+    }
+    s_cached_bytes.fetchAndAddRelaxed(-qint64(m_bytes));
+    t_arena_destroyed = true;
+}
+
+JxlArena *threadArena()
+{
+    if (t_arena_destroyed) {
+        return nullptr;
+    }
+
+    static thread_local JxlArena arena;
+    return &arena;
+}
+}
+
+QJpegXLMemoryManager::QJpegXLMemoryManager(qint64 limit)
+    : m_limit(limit)
+    , m_current_bytes(0)
+    , m_peak_bytes(0)
+    , m_allocation_count(0)
+{
+    m_jxl_manager.opaque = this;
+    m_jxl_manager.alloc = jxlAlloc;
+    m_jxl_manager.free = jxlFree;
+}
+
+const JxlMemoryManager *QJpegXLMemoryManager::jxlMemoryManager() const
+{
+    return &m_jxl_manager;
+}
+
+void *QJpegXLMemoryManager::allocate(size_t size)
+{
+    if (size > size_t(std::numeric_limits<qint64>::max() / 2)) {
+        return nullptr;
+    }
+
+    const qint64 current = m_current_bytes.fetchAndAddOrdered(qint64(size)) + qint64(size);
+    if (m_limit > 0 && current > m_limit) {
+        m_current_bytes.fetchAndAddOrdered(-qint64(size));
+        return nullptr;
+    }
+
+    const size_t capacity = blockCapacity(size);
+    JxlArena *arena = threadArena();
+    BlockHeader *block = arena ? arena->take(capacity) : nullptr;
+    if (!block) {
+        block = static_cast<BlockHeader *>(malloc(sizeof(BlockHeader) + capacity));
+        if (!block) {
+            m_current_bytes.fetchAndAddOrdered(-qint64(size));
+            return nullptr;
+        }
+        block->capacity = capacity;
+    }
+    block->size = size;
+
+    m_allocation_count.fetchAndAddRelaxed(1);
+    qint64 peak = m_peak_bytes.loadRelaxed();
+    while (current > peak && !m_peak_bytes.testAndSetRelaxed(peak, current, peak)) { }
+
+    return block + 1;
+}
+
+void QJpegXLMemoryManager::release(void *address)
+{
+    if (!address) {
+        return;
+    }
+
+    BlockHeader *block = static_cast<BlockHeader *>(address) - 1;
+    m_current_bytes.fetchAndAddOrdered(-qint64(block->size));
+    JxlArena *arena = threadArena();
+    if (arena) {
+        arena->give(block);
+    } else {
+        free(block);
+    }
+}
+
+qint64 QJpegXLMemoryManager::currentBytes() const
+{
+    return m_current_bytes.loadRelaxed();
+}
+
+qint64 QJpegXLMemoryManager::peakBytes() const
+{
+    return m_peak_bytes.loadRelaxed();
+}
+
+qint64 QJpegXLMemoryManager::allocationCount() const
+{
+    return m_allocation_count.loadRelaxed();
+}
+
+qint64 QJpegXLMemoryManager::cachedBytes()
+{
+    return s_cached_bytes.loadRelaxed();
+}
+
+void *QJpegXLMemoryManager::jxlAlloc(void *opaque, size_t size)
+{
+    return static_cast<QJpegXLMemoryManager *>(opaque)->allocate(size);
+}
+
+void QJpegXLMemoryManager::jxlFree(void *opaque, void *address)
+{
+    static_cast<QJpegXLMemoryManager *>(opaque)->release(address);
+}
@@ -0,0 +1,48 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#ifndef QJPEGXLMEMORY_P_H
+#define QJPEGXLMEMORY_P_H
+
+#include <QAtomicInteger>
+#include <QtGlobal>
+
+#include <jxl/memory_manager.h>
+
+/* Allocator of libjxl and of the temporary buffers of the plug-in.
+ * Freed blocks stay in an arena of the thread which freed them and are reused
+ * by later allocations of a similar size, so batch decoding does not return
+ * large buffers to the system after every image. The arenas of all threads keep
+ * at most 64 MiB together; these bytes are not counted by any manager.
+ * Allocations over the limit return nullptr, libjxl reports them as an error. */
+class QJpegXLMemoryManager
+{
+public:
+    explicit QJpegXLMemoryManager(qint64 limit = 0);
+
+    const JxlMemoryManager *jxlMemoryManager() const;
+
+    void *allocate(size_t size);
+    void release(void *address);
+
+    qint64 currentBytes() const;
+    qint64 peakBytes() const;
+    qint64 allocationCount() const;
+
+    // freed bytes kept for reuse by the arenas of the process
+    static qint64 cachedBytes();
+
+private:
+    static void *jxlAlloc(void *opaque, size_t size);
+    static void jxlFree(void *opaque, void *address);
+
+    JxlMemoryManager m_jxl_manager;
+    qint64 m_limit; // 0 when unlimited
+    QAtomicInteger<qint64> m_current_bytes;
+    QAtomicInteger<qint64> m_peak_bytes;
+    QAtomicInteger<qint64> m_allocation_count;
+};
+
+#endif // QJPEGXLMEMORY_P_H
@@ -0,0 +1,137 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#include <QBuffer>
+
+#include "qjpegxlhandler_p.h"
+#include "qjpegxlprefetcher_p.h"
+
+QJpegXLPrefetcher::QJpegXLPrefetcher(const QByteArray &data,
+                                     int frame_count,
+                                     int first_frame,
+                                     int depth,
+                                     const QSize &scaled_size,
+                                     const QRect &clip_rect)
+    : m_data(data)
+    , m_frame_count(frame_count)
+    , m_first_frame(first_frame)
+    , m_scaled_size(scaled_size)
+    , m_clip_rect(clip_rect)
+    , m_slots(qMax(1, depth))
+    , m_slot_sequences(qMax(1, depth))
+    , m_free_slots(qMax(1, depth))
+    , m_ready_slots(0)
+    , m_stop(0)
+    , m_consumer_sequence(0)
+    , m_sequence(0)
+    , m_head(0)
+    , m_tail(0)
+{
+}
+
+QJpegXLPrefetcher::~QJpegXLPrefetcher()
+{
+    requestStop();
+    wait();
+}
+
+void QJpegXLPrefetcher::requestStop()
+{
+    if (m_stop.testAndSetOrdered(0, 1)) {
+        m_free_slots.release(); // wake up the producer waiting for a free slot
+    }
+}
+
+void QJpegXLPrefetcher::releaseHead()
+{
+    m_slots[m_head] = QImage();
+    m_head = (m_head + 1) % m_slots.count();
+    m_free_slots.release();
+}
+
+bool QJpegXLPrefetcher::take(QImage *image)
+{
+    for (;;) {
+        m_ready_slots.acquire();
+        const int sequence = m_slot_sequences[m_head];
+        *image = m_slots[m_head];
+        releaseHead();
+
+        if (image->isNull()) { // the producer has stopped
+            return false;
+        }
+
+        if (sequence == m_sequence) {
+            break;
+        }
+        // decoded before the producer noticed the skip
+    }
+
+    m_sequence++;
+    m_consumer_sequence.storeRelease(m_sequence);
+    return true;
+}
+
+void QJpegXLPrefetcher::skip()
+{
+    m_sequence++;
+    m_consumer_sequence.storeRelease(m_sequence);
+
+    // frames already passed are dropped, so the producer does not wait for their slots
+    while (m_ready_slots.tryAcquire()) {
+        if (m_slots[m_head].isNull() || m_slot_sequences[m_head] >= m_sequence) {
+            m_ready_slots.release(); // still needed
+            break;
+        }
+        releaseHead();
+    }
+}
+
+void QJpegXLPrefetcher::run()
+{
+    QBuffer buffer(&m_data);
+    QJpegXLHandler handler;
+    handler.m_prefetch_depth = 0;
+    handler.m_frame_cache.setMaxCost(0);
+    handler.setDevice(&buffer);
+    if (m_scaled_size.isValid()) {
+        handler.setOption(QImageIOHandler::ScaledSize, m_scaled_size);
+    }
+    if (m_clip_rect.isValid()) {
+        handler.setOption(QImageIOHandler::ClipRect, m_clip_rect);
+    }
+
+    int sequence = 0;
+    bool ok = buffer.open(QIODevice::ReadOnly) && handler.jumpToImage(m_first_frame);
+    for (;;) {
+        m_free_slots.acquire();
+        if (m_stop.loadAcquire()) {
+            break;
+        }
+
+        // frames which the consumer got from its cache are not decoded
+        const int consumer_sequence = m_consumer_sequence.loadAcquire();
+        if (ok && sequence < consumer_sequence) {
+            sequence = consumer_sequence;
+            ok = handler.jumpToImage((m_first_frame + sequence) % m_frame_count);
+        }
+
+        QImage frame;
+        if (ok) {
+            ok = handler.read(&frame) && !frame.isNull();
+        }
+
+        // a null image tells the consumer to decode the frame itself
+        m_slots[m_tail] = ok ? frame : QImage();
+        m_slot_sequences[m_tail] = sequence;
+        m_tail = (m_tail + 1) % m_slots.count();
+        sequence++;
+        m_ready_slots.release();
+
+        if (!ok) {
+            break;
+        }
+    }
+}
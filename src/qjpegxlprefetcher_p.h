@@ -0,0 +1,68 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#ifndef QJPEGXLPREFETCHER_P_H
+#define QJPEGXLPREFETCHER_P_H
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QImage>
+#include <QRect>
+#include <QSemaphore>
+#include <QSize>
+#include <QThread>
+#include <QVector>
+
+/* Decodes the following frames of an animation in a background thread, using
+ * its own decoder over the same data. Up to depth frames are decoded ahead;
+ * they are handed over in order through a ring of slots, where the producer
+ * and the consumer meet only on the two semaphores. Frames which the consumer
+ * got from its cache are skipped by the producer. */
+class QJpegXLPrefetcher : public QThread
+{
+public:
+    QJpegXLPrefetcher(const QByteArray &data, int frame_count, int first_frame, int depth, const QSize &scaled_size, const QRect &clip_rect);
+    ~QJpegXLPrefetcher();
+
+    // frame returned by the next take()
+    int nextFrame() const
+    {
+        return (m_first_frame + m_sequence) % m_frame_count;
+    }
+
+    /* Waits for the next frame; false when it could not be decoded.
+     * Called only from the thread which created the prefetcher. */
+    bool take(QImage *image);
+
+    /* The consumer got the next frame elsewhere; does not wait for the producer. */
+    void skip();
+
+    /* Lets the producer finish the frame in progress and exit, without waiting for it. */
+    void requestStop();
+
+protected:
+    void run() override;
+
+private:
+    void releaseHead();
+
+    QByteArray m_data;
+    int m_frame_count;
+    int m_first_frame;
+    QSize m_scaled_size;
+    QRect m_clip_rect;
+
+    QVector<QImage> m_slots;
+    QVector<int> m_slot_sequences; // position of the frame in the slot, counted from first_frame
+    QSemaphore m_free_slots;
+    QSemaphore m_ready_slots;
+    QAtomicInt m_stop;
+    QAtomicInt m_consumer_sequence; // m_sequence, published for the producer
+    int m_sequence; // consumer side
+    int m_head; // consumer side
+    int m_tail; // producer side
+};
+
+#endif // QJPEGXLPREFETCHER_P_H
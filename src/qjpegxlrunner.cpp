@@ -0,0 +1,334 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#include <QAtomicInt>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThread>
+#include <QThreadPool>
+#include <QtGlobal>
+
+#include "qjpegxlrunner_p.h"
+
+#include <jxl/thread_parallel_runner.h>
+
+// libjxl processes frames in groups of 256 x 256 pixels
+static constexpr quint64 kJxlGroupDim = 256;
+
+namespace
+{
+class ParallelHelper;
+
+/* One call of the runner. Values are claimed from a shared counter by the calling
+ * thread and by the helpers which QThreadPool managed to start. The job is deleted
+ * by whoever drops the last reference. */
+struct ParallelJob {
+    ParallelJob()
+        : jpegxl_opaque(nullptr)
+        , func(nullptr)
+        , end_range(0)
+    {
+    }
+    ~ParallelJob();
+
+    void work(size_t thread_id)
+    {
+        for (;;) {
+            const quint32 value = next_value.fetchAndAddRelaxed(1);
+            if (value >= end_range) {
+                break;
+            }
+            func(jpegxl_opaque, value, thread_id);
+        }
+    }
+
+    void deref()
+    {
+        if (!ref.deref()) {
+            delete this;
+        }
+    }
+
+    void *jpegxl_opaque;
+    JxlParallelRunFunction func;
+    quint32 end_range;
+    QAtomicInteger<quint32> next_value;
+    QAtomicInt next_thread_id;
+    QAtomicInt ref;
+    QSemaphore finished;
+    QVector<ParallelHelper *> helpers;
+};
+
+class ParallelHelper : public QRunnable
+{
+public:
+    explicit ParallelHelper(ParallelJob *job)
+        : m_job(job)
+    {
+        // owned by the job, it may be still referenced by QThreadPool::tryTake()
+        setAutoDelete(false);
+    }
+
+    void run() override
+    {
+        m_job->work(m_job->next_thread_id.fetchAndAddRelaxed(1));
+        m_job->finished.release();
+        m_job->deref();
+    }
+
+private:
+    ParallelJob *m_job;
+};
+
+ParallelJob::~ParallelJob()
+{
+    qDeleteAll(helpers);
+}
+}
+
+QJpegXLRunnerPool::QJpegXLRunnerPool()
+    : m_refcount(0)
+    , m_created_threads(0)
+    , m_max_threads(qBound(1, QThread::idealThreadCount(), 64))
+{
+}
+
+QJpegXLRunnerPool::~QJpegXLRunnerPool()
+{
+    if (m_refcount > 0) {
+        // some handler was not destroyed, its runner may be still in use
+        return;
+    }
+
+    for (const IdleRunner &idle : m_idle_runners) {
+        JxlThreadParallelRunnerDestroy(idle.runner);
+    }
+}
+
+QJpegXLRunnerPool *QJpegXLRunnerPool::acquire()
+{
+    static QJpegXLRunnerPool pool;
+
+    QMutexLocker locker(&pool.m_mutex);
+    pool.m_refcount++;
+    return &pool;
+}
+
+void QJpegXLRunnerPool::release()
+{
+    QMutexLocker locker(&m_mutex);
+    m_refcount--;
+}
+
+void *QJpegXLRunnerPool::takeRunner(int threads)
+{
+    QMutexLocker locker(&m_mutex);
+    for (int i = 0; i < m_idle_runners.size(); i++) {
+        if (m_idle_runners.at(i).threads == threads) {
+            void *runner = m_idle_runners.at(i).runner;
+            m_idle_runners.removeAt(i);
+            return runner;
+        }
+    }
+
+    // make room for a runner of requested size by destroying idle runners of other sizes
+    while (m_created_threads + threads > m_max_threads && !m_idle_runners.isEmpty()) {
+        const IdleRunner idle = m_idle_runners.takeLast();
+        JxlThreadParallelRunnerDestroy(idle.runner);
+        m_created_threads -= idle.threads;
+    }
+
+    if (m_created_threads + threads > m_max_threads) {
+        return nullptr;
+    }
+
+    void *runner = JxlThreadParallelRunnerCreate(nullptr, threads);
+    if (runner) {
+        m_created_threads += threads;
+    }
+    return runner;
+}
+
+void QJpegXLRunnerPool::returnRunner(void *runner, int threads)
+{
+    QMutexLocker locker(&m_mutex);
+    IdleRunner idle;
+    idle.runner = runner;
+    idle.threads = threads;
+    m_idle_runners.append(idle);
+}
+
+QJpegXLRunner::QJpegXLRunner()
+    : m_pool(nullptr)
+    , m_thread_pool(nullptr)
+    , m_worker_threads(1)
+{
+    if (qgetenv("QT_JPEGXL_RUNNER") != "threads") {
+        m_thread_pool = QThreadPool::globalInstance();
+    }
+}
+
+QJpegXLRunner::~QJpegXLRunner()
+{
+    if (m_pool) {
+        m_pool->release();
+    }
+}
+
+int QJpegXLRunner::workerThreadsFor(quint64 xsize, quint64 ysize)
+{
+    bool env_ok = false;
+    const int env_threads = qEnvironmentVariableIntValue("QT_JPEGXL_THREADS", &env_ok);
+    if (env_ok && env_threads > 0) {
+        return qBound(1, env_threads, 64);
+    }
+
+    const int ideal_threads = QThread::idealThreadCount();
+    if (ideal_threads < 4) {
+        return 1;
+    }
+
+    // there is no parallelism inside a single group, tiny images are decoded in the calling thread
+    const quint64 groups = ((xsize + kJxlGroupDim - 1) / kJxlGroupDim) * ((ysize + kJxlGroupDim - 1) / kJxlGroupDim);
+    if (groups <= 1) {
+        return 1;
+    }
+
+    /* use half of the threads because plug-in is usually used in environment
+     * where application performs another tasks in backround (pre-load other images) */
+    int threads = qBound(2, ideal_threads / 2, 64);
+
+    // leave cores busy with application's background work alone
+    const int free_threads = ideal_threads - QThreadPool::globalInstance()->activeThreadCount();
+    threads = qMax(2, qMin(threads, free_threads));
+
+    if (quint64(threads) > groups) {
+        threads = int(groups);
+    }
+
+    // round down to power of two, so runners of few sizes are shared between images
+    int rounded = 1;
+    while (rounded * 2 <= threads) {
+        rounded *= 2;
+    }
+    return rounded;
+}
+
+void QJpegXLRunner::setWorkerThreads(int threads)
+{
+    m_worker_threads = qMax(1, threads);
+    if (m_worker_threads > 1 && !m_pool && !m_thread_pool) {
+        m_pool = QJpegXLRunnerPool::acquire();
+    }
+}
+
+int QJpegXLRunner::workerThreads() const
+{
+    return m_worker_threads;
+}
+
+bool QJpegXLRunner::isParallel() const
+{
+    return m_worker_threads > 1;
+}
+
+JxlParallelRetCode QJpegXLRunner::run(void *runner_opaque,
+                                      void *jpegxl_opaque,
+                                      JxlParallelRunInit init,
+                                      JxlParallelRunFunction func,
+                                      uint32_t start_range,
+                                      uint32_t end_range)
+{
+    const QJpegXLRunner *self = static_cast<const QJpegXLRunner *>(runner_opaque);
+
+    if (self->m_thread_pool && self->m_worker_threads > 1) {
+        return runOnThreadPool(self->m_thread_pool, self->m_worker_threads, jpegxl_opaque, init, func, start_range, end_range);
+    }
+
+    void *runner = nullptr;
+    if (self->m_pool && self->m_worker_threads > 1) {
+        runner = self->m_pool->takeRunner(self->m_worker_threads);
+    }
+
+    if (!runner) {
+        // single-threaded or all shared threads are busy, run the tasks in the calling thread
+        const JxlParallelRetCode init_ret = init(jpegxl_opaque, 1);
+        if (init_ret != JXL_PARALLEL_RET_SUCCESS) {
+            return init_ret;
+        }
+
+        for (uint32_t value = start_range; value < end_range; value++) {
+            func(jpegxl_opaque, value, 0);
+        }
+        return JXL_PARALLEL_RET_SUCCESS;
+    }
+
+    const JxlParallelRetCode ret = JxlThreadParallelRunner(runner, jpegxl_opaque, init, func, start_range, end_range);
+    self->m_pool->returnRunner(runner, self->m_worker_threads);
+    return ret;
+}
+
+JxlParallelRetCode QJpegXLRunner::runOnThreadPool(QThreadPool *thread_pool,
+                                                  int max_threads,
+                                                  void *jpegxl_opaque,
+                                                  JxlParallelRunInit init,
+                                                  JxlParallelRunFunction func,
+                                                  uint32_t start_range,
+                                                  uint32_t end_range)
+{
+    const quint32 count = (end_range > start_range) ? end_range - start_range : 0;
+    const int threads = int(qBound(quint32(1), count, quint32(max_threads)));
+
+    const JxlParallelRetCode init_ret = init(jpegxl_opaque, threads);
+    if (init_ret != JXL_PARALLEL_RET_SUCCESS) {
+        return init_ret;
+    }
+
+    if (threads == 1) {
+        for (uint32_t value = start_range; value < end_range; value++) {
+            func(jpegxl_opaque, value, 0);
+        }
+        return JXL_PARALLEL_RET_SUCCESS;
+    }
+
+    ParallelJob *job = new ParallelJob;
+    job->jpegxl_opaque = jpegxl_opaque;
+    job->func = func;
+    job->end_range = end_range;
+    job->next_value.storeRelaxed(start_range);
+    job->next_thread_id.storeRelaxed(1); // thread 0 is the calling thread
+    job->ref.storeRelaxed(threads); // calling thread + helpers
+    job->helpers.reserve(threads - 1);
+    for (int i = 1; i < threads; i++) {
+        job->helpers.append(new ParallelHelper(job));
+    }
+
+    for (ParallelHelper *helper : job->helpers) {
+        thread_pool->start(helper);
+    }
+
+    job->work(0);
+
+    /* Helpers still waiting in the queue are taken back, so the calling thread
+     * never waits for a pool occupied by other work (it may be one of its threads). */
+    int started_helpers = 0;
+    int taken_helpers = 0;
+    for (ParallelHelper *helper : job->helpers) {
+        if (thread_pool->tryTake(helper)) {
+            taken_helpers++;
+        } else {
+            started_helpers++;
+        }
+    }
+
+    job->finished.acquire(started_helpers);
+
+    for (int i = 0; i < taken_helpers; i++) {
+        job->deref();
+    }
+    job->deref();
+
+    return JXL_PARALLEL_RET_SUCCESS;
+}
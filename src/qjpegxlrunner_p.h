@@ -0,0 +1,89 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+#ifndef QJPEGXLRUNNER_P_H
+#define QJPEGXLRUNNER_P_H
+
+#include <QMutex>
+#include <QVector>
+
+#include <jxl/parallel_runner.h>
+
+class QThreadPool;
+
+/* Pool of JxlThreadParallelRunner instances shared by all decoders and encoders
+ * of the process. The total number of worker threads is bounded; when no runner
+ * can be provided, the parallel tasks are executed in the calling thread. */
+class QJpegXLRunnerPool
+{
+public:
+    static QJpegXLRunnerPool *acquire();
+    void release();
+
+    void *takeRunner(int threads);
+    void returnRunner(void *runner, int threads);
+
+private:
+    QJpegXLRunnerPool();
+    ~QJpegXLRunnerPool();
+    Q_DISABLE_COPY(QJpegXLRunnerPool)
+
+    struct IdleRunner {
+        void *runner;
+        int threads;
+    };
+
+    QMutex m_mutex;
+    int m_refcount;
+    int m_created_threads;
+    int m_max_threads;
+    QVector<IdleRunner> m_idle_runners;
+};
+
+/* Parallel runner of one decoder or encoder.
+ * Pass QJpegXLRunner::run and a pointer to this object to libjxl.
+ *
+ * By default the tasks are scheduled on QThreadPool::globalInstance(), so they
+ * share the cores with the application's own background jobs and follow its
+ * maxThreadCount(). QT_JPEGXL_RUNNER=threads selects the private threads of
+ * QJpegXLRunnerPool instead. */
+class QJpegXLRunner
+{
+public:
+    QJpegXLRunner();
+    ~QJpegXLRunner();
+
+    /* Number of worker threads suitable for an image of given size.
+     * QT_JPEGXL_THREADS environment variable overrides the automatic choice. */
+    static int workerThreadsFor(quint64 xsize, quint64 ysize);
+
+    void setWorkerThreads(int threads);
+    int workerThreads() const;
+    bool isParallel() const;
+
+    static JxlParallelRetCode run(void *runner_opaque,
+                                  void *jpegxl_opaque,
+                                  JxlParallelRunInit init,
+                                  JxlParallelRunFunction func,
+                                  uint32_t start_range,
+                                  uint32_t end_range);
+
+private:
+    Q_DISABLE_COPY(QJpegXLRunner)
+
+    static JxlParallelRetCode runOnThreadPool(QThreadPool *thread_pool,
+                                              int max_threads,
+                                              void *jpegxl_opaque,
+                                              JxlParallelRunInit init,
+                                              JxlParallelRunFunction func,
+                                              uint32_t start_range,
+                                              uint32_t end_range);
+
+    QJpegXLRunnerPool *m_pool;
+    QThreadPool *m_thread_pool;
+    int m_worker_threads;
+};
+
+#endif // QJPEGXLRUNNER_P_H
@@ -0,0 +1,91 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+/* Reads JPEG XL files repeatedly through QImageReader and prints the time spent.
+ * Run it once with QT_JPEGXL_DECODER_POOL=0 and once with the default pool
+ * to see what reusing decoders saves for many small files. */
+
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QImage>
+#include <QImageReader>
+#include <QStringList>
+#include <QtGlobal>
+
+#include <cstdio>
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    const QStringList arguments = app.arguments();
+    int first_file = 1;
+
+    int rounds = 10;
+    if (arguments.size() >= 3 && arguments.at(1) == QLatin1String("-n")) {
+        rounds = qMax(1, arguments.at(2).toInt());
+        first_file = 3;
+    }
+
+    if (first_file >= arguments.size()) {
+        fprintf(stderr, "Usage: jxlbench [-n rounds] <file.jxl or directory>...\n");
+        return 1;
+    }
+
+    QStringList list;
+    for (int i = first_file; i < arguments.size(); i++) {
+        const QString &argument = arguments.at(i);
+        const QFileInfo info(argument);
+        if (info.isDir()) {
+            const QFileInfoList entries = QDir(argument).entryInfoList(QStringList() << QStringLiteral("*.jxl"), QDir::Files, QDir::Name);
+            for (const QFileInfo &entry : entries) {
+                list.append(entry.filePath());
+            }
+        } else {
+            list.append(argument);
+        }
+    }
+    const QStringList files = list;
+
+    // the first reading loads the plug-in and warms up the caches
+    for (const QString &file : files) {
+        QImageReader reader(file, "jxl");
+        reader.read();
+    }
+
+    qint64 images = 0;
+    qint64 failures = 0;
+    QElapsedTimer timer;
+    timer.start();
+
+    for (int round = 0; round < rounds; round++) {
+        for (const QString &file : files) {
+            QImageReader reader(file, "jxl");
+            // jumpToNextImage() of the plug-in wraps around, every frame is read once
+            const int frame_count = qMax(1, reader.imageCount());
+            for (int frame = 0; frame < frame_count; frame++) {
+                const QImage image = reader.read();
+                if (image.isNull()) {
+                    failures++;
+                    break;
+                }
+                images++;
+            }
+        }
+    }
+
+    const qint64 elapsed = qMax<qint64>(1, timer.nsecsElapsed() / 1000);
+    const QByteArray pool = qgetenv("QT_JPEGXL_DECODER_POOL");
+
+    printf("%d files, %d rounds, %lld images decoded, %lld failed\n", int(files.size()), rounds, images, failures);
+    printf("QT_JPEGXL_DECODER_POOL=%s: %.3f ms total, %.1f us per image\n",
+           pool.isEmpty() ? "(default)" : pool.constData(),
+           elapsed / 1000.0,
+           images > 0 ? double(elapsed) / images : 0.0);
+    return failures > 0 ? 2 : 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * QT plug-in to allow import/export in JPEG XL image format.
+ * Author: Daniel Novomesky
+ */
+
+/* Lossless JPEG <-> JPEG XL conversion through the QJpegXLJpeg library:
+ *   jxljpeg compress input.jpg output.jxl
+ *   jxljpeg reconstruct input.jxl output.jpg
+ *   jxljpeg roundtrip input.jpg
+ * roundtrip recompresses the JPEG in memory, reconstructs it and checks
+ * that the reconstructed bitstream is identical to the input. */
+
+#include <QBuffer>
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QFile>
+#include <QStringList>
+
+#include "qjpegxljpeg.h"
+
+#include <cstdio>
+
+static bool readFile(const QString &name, QByteArray *data)
+{
+    QFile file(name);
+    if (!file.open(QIODevice::ReadOnly)) {
+        fprintf(stderr, "Cannot open %s\n", qUtf8Printable(name));
+        return false;
+    }
+    *data = file.readAll();
+    return true;
+}
+
+static bool writeFile(const QString &name, const QByteArray &data)
+{
+    QFile file(name);
+    if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size()) {
+        fprintf(stderr, "Cannot write %s\n", qUtf8Printable(name));
+        return false;
+    }
+    return true;
+}
+
+static bool compress(const QByteArray &jpeg_data, QByteArray *jxl_data)
+{
+    QBuffer buffer(jxl_data);
+    buffer.open(QIODevice::WriteOnly);
+    return QJpegXLJpeg::transcodeJpeg(jpeg_data, &buffer);
+}
+
+static bool reconstruct(QByteArray *jxl_data, QByteArray *jpeg_data)
+{
+    QBuffer buffer(jxl_data);
+    buffer.open(QIODevice::ReadOnly);
+    return QJpegXLJpeg::reconstructJpeg(&buffer, jpeg_data);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    const QStringList arguments = app.arguments();
+
+    const QString command = arguments.size() > 2 ? arguments.at(1) : QString();
+    QByteArray input;
+    QByteArray output;
+
+    if (command == QLatin1String("compress") && arguments.size() == 4) {
+        if (!readFile(arguments.at(2), &input) || !compress(input, &output)) {
+            fprintf(stderr, "JPEG recompression failed\n");
+            return 2;
+        }
+        return writeFile(arguments.at(3), output) ? 0 : 2;
+    }
+
+    if (command == QLatin1String("reconstruct") && arguments.size() == 4) {
+        if (!readFile(arguments.at(2), &input) || !reconstruct(&input, &output)) {
+            fprintf(stderr, "The file carries no JPEG reconstruction data\n");
+            return 2;
+        }
+        return writeFile(arguments.at(3), output) ? 0 : 2;
+    }
+
+    if (command == QLatin1String("roundtrip") && arguments.size() == 3) {
+        QByteArray reconstructed;
+        if (!readFile(arguments.at(2), &input) || !compress(input, &output) || !reconstruct(&output, &reconstructed)) {
+            fprintf(stderr, "JPEG round trip failed\n");
+            return 2;
+        }
+        if (reconstructed != input) {
+            fprintf(stderr, "Reconstructed JPEG differs from the original\n");
+            return 3;
+        }
+        printf("%lld bytes of JPEG stored in %lld bytes of JPEG XL, reconstructed bit-exact\n", qint64(input.size()), qint64(output.size()));
+        return 0;
+    }
+
+    fprintf(stderr,
+            "Usage: jxljpeg compress <input.jpg> <output.jxl>\n"
+            "       jxljpeg reconstruct <input.jxl> <output.jpg>\n"
+            "       jxljpeg roundtrip <input.jpg>\n");
+    return 1;
+}